@@ -17,6 +17,8 @@ using namespace glm;
 #include <common/shader.hpp>
 #include <iostream>
 
+#include "../../shared/render_queue.hpp"
+
 int InitWindow() {
 	// Initialise GLFW
 	if (!glfwInit())
@@ -74,16 +76,12 @@ int main( void )
 	glBindVertexArray(VertexArrayID);
 
 	// Create and compile our GLSL program from the shaders
-	GLuint shaderIds[] = {
-		LoadShaders("SimpleTransform.vertexshader", "RedColor.fragmentshader"),
-		LoadShaders("SimpleTransform.vertexshader", "GreenColor.fragmentshader"),
-	};
+	// Both triangles share it, only the "Color" uniform differs per draw
+	GLuint programID = LoadShaders("SimpleTransform.vertexshader", "UniformColor.fragmentshader");
 
-	// Get a handle for our "MVP" uniform
-	GLuint MatrixIDs[] = {
-		glGetUniformLocation(shaderIds[0], "MVP"),
-		glGetUniformLocation(shaderIds[1], "MVP")
-	};
+	// Get a handle for our "MVP" and "Color" uniforms
+	GLuint MatrixID = glGetUniformLocation(programID, "MVP");
+	GLint ColorID = glGetUniformLocation(programID, "Color");
 
 	// Projection matrix : 45 Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
 	glm::mat4 Projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 100.0f);
@@ -119,6 +117,22 @@ int main( void )
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
+	RenderQueue queue;
+	uint16_t program = queue.AddProgram(programID, ColorID, [&] {
+		// Send our transformation to the currently bound shader, 
+		// in the "MVP" uniform
+		glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &MVP[0][0]);
+	});
+	uint16_t material = queue.AddMaterial({});
+	uint16_t mesh = queue.AddMesh({ { vertexbuffer, 0, 0 } });
+
+	const glm::vec4 colors[] = {
+		glm::vec4(1, 0, 0, 0.5),
+		glm::vec4(0, 1, 0, 0.5),
+	};
+	RenderQueue::Stats totals;
+	size_t frames = 0;
+
 	const float radius = 3.0f;
 
 	do {
@@ -140,30 +154,17 @@ int main( void )
 		MVP = Projection * View * Model;
 
 		for (int i = 0; i < 2; ++i) {
-			// Use our shader
-			glUseProgram(shaderIds[i]);
-
-			// Send our transformation to the currently bound shader, 
-			// in the "MVP" uniform
-			glUniformMatrix4fv(MatrixIDs[i], 1, GL_FALSE, &MVP[0][0]);
-
-			// 1rst attribute buffer : vertices
-			glEnableVertexAttribArray(0);
-			glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-			glVertexAttribPointer(
-				0,                  // attribute. No particular reason for 0, but must match the layout in the shader.
-				3,                  // size
-				GL_FLOAT,           // type
-				GL_FALSE,           // normalized?
-				0,                  // stride
-				(void*)0            // array buffer offset
-			);
-
-			// Draw the triangle !
-			glDrawArrays(GL_TRIANGLES, i * 3, 3); // 3 indices starting at 0 -> 1 triangle
-
-			glDisableVertexAttribArray(0);
+			RenderQueue::Draw draw;
+			draw.First = i * 3; // 3 indices starting at i * 3 -> 1 triangle
+			draw.Count = 3;
+			draw.Param = colors[i];
+			// Keep the submission order, the triangles are blended
+			queue.Submit(program, material, mesh, draw, i);
 		}
+		queue.Flush();
+
+		totals += queue.LastStats();
+		++frames;
 
 		// Swap buffers
 		glfwSwapBuffers(window);
@@ -173,10 +174,15 @@ int main( void )
 	while( glfwGetKey(window, GLFW_KEY_ESCAPE ) != GLFW_PRESS &&
 		   glfwWindowShouldClose(window) == 0 );
 
+	if (frames > 0) {
+		std::cout << "draws/frame " << double(totals.Draws) / frames
+			<< ", state changes/frame " << double(totals.Changes()) / frames
+			<< " (" << double(totals.NaiveChanges) / frames << " without sorting and elision)" << std::endl;
+	}
+
 	// Cleanup VBO and shader
 	glDeleteBuffers(1, &vertexbuffer);
-	glDeleteProgram(shaderIds[0]);
-	glDeleteProgram(shaderIds[1]);
+	glDeleteProgram(programID);
 	glDeleteVertexArrays(1, &VertexArrayID);
 
 	// Close OpenGL window and terminate GLFW
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Keeps the compiler from dropping a result the benchmark never looks at
+template <class T>
+inline void DoNotOptimize(const T& value) {
+#ifdef _MSC_VER
+    static volatile const void* sink;
+    sink = &value;
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : "r,m"(value) : "memory");
+#endif
+}
+
+// Cycles, instructions, cache and branch misses of this thread through
+// perf_event_open, read as one group. Unavailable off Linux, or when
+// kernel.perf_event_paranoid or a container forbids it; then every call is a no-op.
+class HardwareCounters {
+public:
+    static constexpr int kCount = 4;
+
+    HardwareCounters() {
+#ifdef __linux__
+        const uint64_t configs[kCount] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        for (auto i = 0; i < kCount; ++i) {
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = leader_ < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            const int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0));
+            if (fd < 0) {
+                if (leader_ < 0)
+                    return;
+                continue;
+            }
+            if (leader_ < 0)
+                leader_ = fd;
+            uint64_t id = 0;
+            ioctl(fd, PERF_EVENT_IOC_ID, &id);
+            events_.push_back({ fd, id, i });
+        }
+#endif
+    }
+
+    ~HardwareCounters() {
+#ifdef __linux__
+        for (auto& e : events_)
+            close(e.Fd);
+#endif
+    }
+
+    HardwareCounters(const HardwareCounters&) = delete;
+    HardwareCounters& operator=(const HardwareCounters&) = delete;
+
+    bool Available() const {
+        return leader_ >= 0;
+    }
+
+    static const char* Name(int counter) {
+        static const char* names[kCount] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+        return names[counter];
+    }
+
+    void Reset() {
+#ifdef __linux__
+        if (Available())
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    void Start() {
+#ifdef __linux__
+        if (Available())
+            ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    void Stop() {
+#ifdef __linux__
+        if (Available())
+            ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    // Totals since Reset(), scaled up if the kernel had to multiplex the
+    // counters; counters that could not be opened read -1
+    void Read(double (&values)[kCount]) const {
+        std::fill(values, values + kCount, -1.0);
+#ifdef __linux__
+        if (!Available())
+            return;
+        // nr, time_enabled, time_running, then a value and id per event
+        uint64_t data[3 + 2 * kCount] = {};
+        if (read(leader_, data, sizeof(data)) <= 0)
+            return;
+        const double scale = data[2] > 0 ? double(data[1]) / data[2] : 1.0;
+        for (uint64_t i = 0; i < data[0] && i < uint64_t(kCount); ++i) {
+            for (auto& e : events_)
+                if (e.Id == data[4 + 2 * i])
+                    values[e.Counter] = data[3 + 2 * i] * scale;
+        }
+#endif
+    }
+
+private:
+    struct Event {
+        int Fd;
+        uint64_t Id;
+        int Counter;
+    };
+
+    int leader_ = -1;
+    std::vector<Event> events_;
+};
+
+// Passed to each benchmark body, which runs its loop Iterations() times.
+// Setup that has to be redone inside the loop goes between PauseTiming() and
+// ResumeTiming(), which stop the clock and the hardware counters.
+class BenchmarkState {
+public:
+    BenchmarkState(size_t iterations, HardwareCounters& counters) :
+        iterations_(iterations),
+        counters_(counters)
+    { }
+
+    size_t Iterations() const {
+        return iterations_;
+    }
+
+    // Work done per iteration (pairs tested, objects written...), reported as items/s
+    void SetItemsPerIteration(double items) {
+        items_ = items;
+    }
+
+    void PauseTiming() {
+        counters_.Stop();
+        elapsed_ += std::chrono::steady_clock::now() - start_;
+    }
+
+    void ResumeTiming() {
+        start_ = std::chrono::steady_clock::now();
+        counters_.Start();
+    }
+
+private:
+    friend class BenchmarkRunner;
+
+    size_t iterations_;
+    HardwareCounters& counters_;
+    double items_ = 0;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::duration elapsed_ = {};
+};
+
+// Runs benchmark bodies in the manner of Google Benchmark: the iteration count
+// grows until one run lasts at least min_seconds, and that run is reported,
+// per iteration, on stdout and in a JSON file of the same shape as
+// --benchmark_format=json so existing comparison tooling can read it.
+class BenchmarkRunner {
+public:
+    struct Result {
+        std::string Name;
+        size_t Iterations;
+        double Nanoseconds;
+        double ItemsPerSecond;
+        double Counters[HardwareCounters::kCount];
+    };
+
+    explicit BenchmarkRunner(double min_seconds = 0.2) : min_seconds_(min_seconds) {
+        printf("%-40s %14s %12s %14s", "Benchmark", "Time", "Iterations", "Items/s");
+        if (counters_.Available()) {
+            for (auto i = 0; i < HardwareCounters::kCount; ++i)
+                printf(" %14s", HardwareCounters::Name(i));
+        }
+        else {
+            printf("  (no hardware counters: perf_event_open unavailable)");
+        }
+        printf("\n");
+    }
+
+    template <class Body>
+    void Run(const std::string& name, Body body) {
+        size_t iterations = 1;
+        for (;;) {
+            BenchmarkState state(iterations, counters_);
+            counters_.Reset();
+            state.ResumeTiming();
+            body(state);
+            state.PauseTiming();
+            const double seconds = std::chrono::duration<double>(state.elapsed_).count();
+
+            if (seconds >= min_seconds_ || iterations >= kMaxIterations) {
+                Result result = { name, iterations, seconds * 1e9 / iterations, seconds > 0 ? state.items_ * iterations / seconds : 0, {} };
+                counters_.Read(result.Counters);
+                for (auto& c : result.Counters)
+                    if (c >= 0)
+                        c /= iterations;
+                Print(result);
+                results_.push_back(result);
+                return;
+            }
+            // Aim a little past the target, growing by at most 10x a step
+            const double wanted = seconds > 0 ? iterations * min_seconds_ * 1.4 / seconds : iterations * 10.0;
+            iterations = std::max(iterations + 1, size_t(std::min(wanted, iterations * 10.0)));
+            iterations = std::min(iterations, kMaxIterations);
+        }
+    }
+
+    bool WriteJson(const std::string& file, const std::string& executable) const {
+        FILE* out = fopen(file.c_str(), "w");
+        if (!out)
+            return false;
+        char date[32];
+        const std::time_t now = std::time(nullptr);
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+        fprintf(out, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"executable\": \"%s\",\n", date, executable.c_str());
+        fprintf(out, "    \"min_time\": %g,\n    \"hardware_counters\": %s\n  },\n  \"benchmarks\": [\n",
+            min_seconds_, counters_.Available() ? "true" : "false");
+        for (size_t i = 0; i < results_.size(); ++i) {
+            auto& r = results_[i];
+            fprintf(out, "    {\n      \"name\": \"%s\",\n      \"run_type\": \"iteration\",\n      \"iterations\": %zu,\n", r.Name.c_str(), r.Iterations);
+            fprintf(out, "      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\"", r.Nanoseconds, r.Nanoseconds);
+            if (r.ItemsPerSecond > 0)
+                fprintf(out, ",\n      \"items_per_second\": %.1f", r.ItemsPerSecond);
+            for (auto c = 0; c < HardwareCounters::kCount; ++c)
+                if (r.Counters[c] >= 0)
+                    fprintf(out, ",\n      \"%s\": %.1f", HardwareCounters::Name(c), r.Counters[c]);
+            fprintf(out, "\n    }%s\n", i + 1 < results_.size() ? "," : "");
+        }
+        fprintf(out, "  ]\n}\n");
+        return fclose(out) == 0;
+    }
+
+private:
+    static constexpr size_t kMaxIterations = 1000000000;
+
+    void Print(const Result& r) const {
+        char time[32];
+        if (r.Nanoseconds >= 1e6)
+            snprintf(time, sizeof(time), "%.3f ms", r.Nanoseconds / 1e6);
+        else if (r.Nanoseconds >= 1e3)
+            snprintf(time, sizeof(time), "%.3f us", r.Nanoseconds / 1e3);
+        else
+            snprintf(time, sizeof(time), "%.1f ns", r.Nanoseconds);
+        printf("%-40s %14s %12zu", r.Name.c_str(), time, r.Iterations);
+        if (r.ItemsPerSecond > 0)
+            printf(" %14.4g", r.ItemsPerSecond);
+        else
+            printf(" %14s", "-");
+        if (counters_.Available()) {
+            for (auto c : r.Counters) {
+                if (c >= 0)
+                    printf(" %14.4g", c);
+                else
+                    printf(" %14s", "-");
+            }
+        }
+        printf("\n");
+    }
+
+    double min_seconds_;
+    HardwareCounters counters_;
+    std::vector<Result> results_;
+};
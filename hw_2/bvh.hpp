@@ -0,0 +1,493 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// The box tests use SSE where the compiler targets it; define BVH_NO_SSE to
+// build the scalar versions instead (for comparison, or other targets)
+#if !defined(BVH_NO_SSE) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define BVH_SSE
+#include <emmintrin.h>
+#endif
+
+// Bounding volume hierarchy over a triangle soup (every three vertices form a
+// triangle, the layout loadOBJ produces). Built once with a binned SAH and
+// stored flattened in depth-first order: the left child of an inner node is
+// the next node, so a traversal mostly walks forward through memory. Nodes
+// deeper than kMaxDepth are not split further, which bounds the traversal
+// stacks: a node at depth d leaves at most d siblings behind on the stack.
+class Bvh {
+public:
+    struct Triangle {
+        glm::vec3 A, B, C;
+    };
+
+    // 32 bytes, two per cache line
+    struct Node {
+        glm::vec3 Min;
+        uint32_t RightOrFirst; // inner node: index of the right child; leaf: first triangle
+        glm::vec3 Max;
+        uint32_t Count;        // 0 for inner nodes
+    };
+    // LoadCorner() reads 16 bytes from Min and Max, the last lane being the
+    // uint32_t after each
+    static_assert(sizeof(Node) == 32 && offsetof(Node, Max) == 16, "Bvh::Node must stay two packed 16 byte halves");
+
+    static constexpr int kBins = 12;
+    static constexpr uint32_t kLeafSize = 4;
+    static constexpr int kMaxDepth = 48;
+    static constexpr int kStackSize = kMaxDepth + 1;
+
+    Bvh() = default;
+
+    explicit Bvh(const std::vector<glm::vec3>& vertices) {
+        const size_t count = vertices.size() / 3;
+        if (count == 0)
+            return;
+        triangles_.resize(count);
+        centroids_.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            triangles_[i] = { vertices[3 * i], vertices[3 * i + 1], vertices[3 * i + 2] };
+            centroids_[i] = (triangles_[i].A + triangles_[i].B + triangles_[i].C) / 3.0f;
+        }
+        nodes_.reserve(2 * count);
+        nodes_.push_back(Node());
+        Build(0, 0, uint32_t(count), 0);
+        centroids_.clear();
+        centroids_.shrink_to_fit();
+    }
+
+    bool Empty() const {
+        return nodes_.empty();
+    }
+
+    const std::vector<Node>& Nodes() const {
+        return nodes_;
+    }
+
+    // Does any triangle come closer than radius to center?
+    bool IntersectsSphere(const glm::vec3& center, float radius) const {
+        if (nodes_.empty())
+            return false;
+        const float radius2 = radius * radius;
+        const Lanes center4 = Load(center);
+        uint32_t stack[kStackSize];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes_[stack[--top]];
+            if (BoxDistance2(node, center4) > radius2)
+                continue;
+            if (node.Count > 0) {
+                for (uint32_t i = node.RightOrFirst; i < node.RightOrFirst + node.Count; ++i) {
+                    const glm::vec3 d = ClosestPoint(center, triangles_[i]) - center;
+                    if (glm::dot(d, d) <= radius2)
+                        return true;
+                }
+                continue;
+            }
+            stack[top++] = node.RightOrFirst;
+            stack[top++] = uint32_t(&node - nodes_.data()) + 1;
+        }
+        return false;
+    }
+
+    // Does a sphere of the given radius moving from a to b touch any triangle?
+    bool IntersectsCapsule(const glm::vec3& a, const glm::vec3& b, float radius) const {
+        if (nodes_.empty())
+            return false;
+        const float radius2 = radius * radius;
+        const glm::vec3 dir = b - a;
+        if (glm::dot(dir, dir) < 1e-12f)
+            return IntersectsSphere(a, radius);
+        const Lanes origin = Load(a);
+        const Lanes inv_dir = Load(glm::vec3(1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]));
+        uint32_t stack[kStackSize];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const uint32_t index = stack[--top];
+            const Node& node = nodes_[index];
+            if (BoxEntry(node, origin, inv_dir, 1.0f, radius) > 1.0f)
+                continue;
+            if (node.Count > 0) {
+                for (uint32_t i = node.RightOrFirst; i < node.RightOrFirst + node.Count; ++i)
+                    if (SegmentTriangleDistance2(a, b, triangles_[i]) <= radius2)
+                        return true;
+                continue;
+            }
+            stack[top++] = node.RightOrFirst;
+            stack[top++] = index + 1;
+        }
+        return false;
+    }
+
+    // Earliest fraction of the move from a to b at which the sphere touches a
+    // triangle, or a value above 1 if it never does. Bisects on the capsule test,
+    // so the result is accurate to 2^-iterations of the move.
+    float SweepSphere(const glm::vec3& a, const glm::vec3& b, float radius, int iterations = 16) const {
+        if (!IntersectsCapsule(a, b, radius))
+            return 2.0f;
+        if (IntersectsSphere(a, radius))
+            return 0.0f;
+        float lo = 0;
+        float hi = 1;
+        for (int i = 0; i < iterations; ++i) {
+            const float mid = (lo + hi) / 2;
+            if (IntersectsCapsule(a, a + (b - a) * mid, radius))
+                hi = mid;
+            else
+                lo = mid;
+        }
+        return hi;
+    }
+
+    // Distance along dir (not necessarily normalized) to the nearest triangle
+    // hit in [0, t_max], or t_max if there is none
+    float Raycast(const glm::vec3& origin, const glm::vec3& dir, float t_max) const {
+        if (nodes_.empty())
+            return t_max;
+        const Lanes origin4 = Load(origin);
+        const Lanes inv_dir = Load(glm::vec3(1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]));
+        float best = t_max;
+        uint32_t stack[kStackSize];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const uint32_t index = stack[--top];
+            const Node& node = nodes_[index];
+            if (BoxEntry(node, origin4, inv_dir, best) > best)
+                continue;
+            if (node.Count > 0) {
+                for (uint32_t i = node.RightOrFirst; i < node.RightOrFirst + node.Count; ++i)
+                    best = std::min(best, RayTriangle(origin, dir, triangles_[i], best));
+                continue;
+            }
+            // Visit the nearer child first so the far one is usually culled
+            uint32_t near_child = index + 1;
+            uint32_t far_child = node.RightOrFirst;
+            if (BoxEntry(nodes_[near_child], origin4, inv_dir, best) > BoxEntry(nodes_[far_child], origin4, inv_dir, best))
+                std::swap(near_child, far_child);
+            stack[top++] = far_child;
+            stack[top++] = near_child;
+        }
+        return best;
+    }
+
+private:
+    void Build(uint32_t index, uint32_t first, uint32_t count, int depth) {
+        Node& node = nodes_[index];
+        node.Min = glm::vec3(FLT_MAX);
+        node.Max = glm::vec3(-FLT_MAX);
+        glm::vec3 cmin(FLT_MAX);
+        glm::vec3 cmax(-FLT_MAX);
+        for (uint32_t i = first; i < first + count; ++i) {
+            Grow(node.Min, node.Max, triangles_[i]);
+            cmin = glm::min(cmin, centroids_[i]);
+            cmax = glm::max(cmax, centroids_[i]);
+        }
+
+        int axis = -1;
+        float split = 0;
+        if (count > kLeafSize && depth < kMaxDepth)
+            FindSplit(first, count, cmin, cmax, node, axis, split);
+        if (axis < 0) {
+            node.RightOrFirst = first;
+            node.Count = count;
+            return;
+        }
+
+        // Partition in place around the split plane
+        uint32_t i = first;
+        uint32_t j = first + count;
+        while (i < j) {
+            if (centroids_[i][axis] < split) {
+                ++i;
+            }
+            else {
+                --j;
+                std::swap(triangles_[i], triangles_[j]);
+                std::swap(centroids_[i], centroids_[j]);
+            }
+        }
+        const uint32_t left_count = i - first;
+        if (left_count == 0 || left_count == count) {
+            node.RightOrFirst = first;
+            node.Count = count;
+            return;
+        }
+
+        node.Count = 0;
+        const uint32_t left = uint32_t(nodes_.size());
+        nodes_.push_back(Node());
+        Build(left, first, left_count, depth + 1);
+        const uint32_t right = uint32_t(nodes_.size());
+        nodes_.push_back(Node());
+        nodes_[index].RightOrFirst = right;
+        Build(right, i, count - left_count, depth + 1);
+    }
+
+    // Binned surface area heuristic; axis stays -1 when no split beats a leaf
+    void FindSplit(uint32_t first, uint32_t count, const glm::vec3& cmin, const glm::vec3& cmax,
+        const Node& node, int& axis, float& split) const {
+        float best_cost = count * Area(node.Min, node.Max);
+        for (int a = 0; a < 3; ++a) {
+            const float extent = cmax[a] - cmin[a];
+            if (extent <= 0)
+                continue;
+            glm::vec3 bmin[kBins];
+            glm::vec3 bmax[kBins];
+            uint32_t bcount[kBins] = {};
+            for (int b = 0; b < kBins; ++b) {
+                bmin[b] = glm::vec3(FLT_MAX);
+                bmax[b] = glm::vec3(-FLT_MAX);
+            }
+            const float scale = kBins / extent;
+            for (uint32_t i = first; i < first + count; ++i) {
+                const int b = std::min(kBins - 1, int((centroids_[i][a] - cmin[a]) * scale));
+                ++bcount[b];
+                Grow(bmin[b], bmax[b], triangles_[i]);
+            }
+
+            // Sweep from the right to get the cost of every right-hand side
+            float right_area[kBins];
+            uint32_t right_count[kBins];
+            glm::vec3 rmin(FLT_MAX);
+            glm::vec3 rmax(-FLT_MAX);
+            uint32_t rcount = 0;
+            for (int b = kBins - 1; b > 0; --b) {
+                rcount += bcount[b];
+                if (bcount[b] > 0) {
+                    rmin = glm::min(rmin, bmin[b]);
+                    rmax = glm::max(rmax, bmax[b]);
+                }
+                right_area[b] = rcount > 0 ? Area(rmin, rmax) : 0;
+                right_count[b] = rcount;
+            }
+            glm::vec3 lmin(FLT_MAX);
+            glm::vec3 lmax(-FLT_MAX);
+            uint32_t lcount = 0;
+            for (int b = 0; b < kBins - 1; ++b) {
+                lcount += bcount[b];
+                if (bcount[b] > 0) {
+                    lmin = glm::min(lmin, bmin[b]);
+                    lmax = glm::max(lmax, bmax[b]);
+                }
+                if (lcount == 0 || right_count[b + 1] == 0)
+                    continue;
+                const float cost = lcount * Area(lmin, lmax) + right_count[b + 1] * right_area[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    axis = a;
+                    split = cmin[a] + (b + 1) / scale;
+                }
+            }
+        }
+    }
+
+    static void Grow(glm::vec3& min, glm::vec3& max, const Triangle& t) {
+        min = glm::min(min, glm::min(t.A, glm::min(t.B, t.C)));
+        max = glm::max(max, glm::max(t.A, glm::max(t.B, t.C)));
+    }
+
+    static float Area(const glm::vec3& min, const glm::vec3& max) {
+        const glm::vec3 e = max - min;
+        return e[0] * e[1] + e[1] * e[2] + e[2] * e[0];
+    }
+
+#ifdef BVH_SSE
+    // A point or direction in the first three lanes, zero in the fourth
+    using Lanes = __m128;
+
+    static Lanes Load(const glm::vec3& v) {
+        return _mm_set_ps(0, v[2], v[1], v[0]);
+    }
+
+    // Node::Min or Node::Max in one load; the index or count after it is masked
+    // off, as a float it would be a denormal and slow down the arithmetic
+    static __m128 LoadCorner(const glm::vec3& corner) {
+        return _mm_and_ps(_mm_loadu_ps(&corner[0]), _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)));
+    }
+
+    // Both box tests give the same results as the scalar versions below: the
+    // operands are ordered as std::min and std::max order them, so an axis the
+    // ray runs along inside a slab (0 * inf = NaN) is skipped the same way
+    static float BoxDistance2(const Node& node, const Lanes& p) {
+        const __m128 below = _mm_sub_ps(LoadCorner(node.Min), p);
+        const __m128 above = _mm_sub_ps(p, LoadCorner(node.Max));
+        const __m128 v = _mm_max_ps(above, _mm_max_ps(below, _mm_setzero_ps()));
+        float v2[4];
+        _mm_storeu_ps(v2, _mm_mul_ps(v, v));
+        return v2[0] + v2[1] + v2[2];
+    }
+
+    // Slab test against the box grown by pad; entry distance, or FLT_MAX on a miss
+    static float BoxEntry(const Node& node, const Lanes& origin, const Lanes& inv_dir, float t_max, float pad = 0) {
+        const __m128 pad4 = _mm_set1_ps(pad);
+        const __m128 near_t = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(LoadCorner(node.Min), pad4), origin), inv_dir);
+        const __m128 far_t = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(LoadCorner(node.Max), pad4), origin), inv_dir);
+        const __m128 swap = _mm_cmpgt_ps(near_t, far_t);
+        const __m128 lo = _mm_or_ps(_mm_and_ps(swap, far_t), _mm_andnot_ps(swap, near_t));
+        const __m128 hi = _mm_or_ps(_mm_and_ps(swap, near_t), _mm_andnot_ps(swap, far_t));
+        // Per axis first, which also drops NaN lanes; then across the axes with
+        // the unused fourth lane replaced by the first
+        __m128 t0 = _mm_max_ps(lo, _mm_setzero_ps());
+        __m128 t1 = _mm_min_ps(hi, _mm_set1_ps(t_max));
+        t0 = _mm_shuffle_ps(t0, t0, _MM_SHUFFLE(0, 2, 1, 0));
+        t1 = _mm_shuffle_ps(t1, t1, _MM_SHUFFLE(0, 2, 1, 0));
+        t0 = _mm_max_ps(t0, _mm_shuffle_ps(t0, t0, _MM_SHUFFLE(1, 0, 3, 2)));
+        t1 = _mm_min_ps(t1, _mm_shuffle_ps(t1, t1, _MM_SHUFFLE(1, 0, 3, 2)));
+        t0 = _mm_max_ps(t0, _mm_shuffle_ps(t0, t0, _MM_SHUFFLE(2, 3, 0, 1)));
+        t1 = _mm_min_ps(t1, _mm_shuffle_ps(t1, t1, _MM_SHUFFLE(2, 3, 0, 1)));
+        const float entry = _mm_cvtss_f32(t0);
+        return entry <= _mm_cvtss_f32(t1) ? entry : FLT_MAX;
+    }
+#else
+    using Lanes = glm::vec3;
+
+    static Lanes Load(const glm::vec3& v) {
+        return v;
+    }
+
+    static float BoxDistance2(const Node& node, const Lanes& p) {
+        float d2 = 0;
+        for (int a = 0; a < 3; ++a) {
+            const float v = std::max(std::max(node.Min[a] - p[a], 0.0f), p[a] - node.Max[a]);
+            d2 += v * v;
+        }
+        return d2;
+    }
+
+    // Slab test against the box grown by pad; entry distance, or FLT_MAX on a miss
+    static float BoxEntry(const Node& node, const Lanes& origin, const Lanes& inv_dir, float t_max, float pad = 0) {
+        float t0 = 0;
+        float t1 = t_max;
+        for (int a = 0; a < 3; ++a) {
+            float near_t = (node.Min[a] - pad - origin[a]) * inv_dir[a];
+            float far_t = (node.Max[a] + pad - origin[a]) * inv_dir[a];
+            if (near_t > far_t)
+                std::swap(near_t, far_t);
+            t0 = std::max(t0, near_t);
+            t1 = std::min(t1, far_t);
+        }
+        return t0 <= t1 ? t0 : FLT_MAX;
+    }
+#endif
+
+    // Moller-Trumbore; t of the hit, or t_max
+    static float RayTriangle(const glm::vec3& origin, const glm::vec3& dir, const Triangle& t, float t_max) {
+        const glm::vec3 e1 = t.B - t.A;
+        const glm::vec3 e2 = t.C - t.A;
+        const glm::vec3 p = glm::cross(dir, e2);
+        const float det = glm::dot(e1, p);
+        if (std::abs(det) < 1e-12f)
+            return t_max;
+        const float inv_det = 1.0f / det;
+        const glm::vec3 s = origin - t.A;
+        const float u = glm::dot(s, p) * inv_det;
+        if (u < 0 || u > 1)
+            return t_max;
+        const glm::vec3 q = glm::cross(s, e1);
+        const float v = glm::dot(dir, q) * inv_det;
+        if (v < 0 || u + v > 1)
+            return t_max;
+        const float hit = glm::dot(e2, q) * inv_det;
+        return hit >= 0 && hit < t_max ? hit : t_max;
+    }
+
+    // Squared distance between a segment and a triangle: zero if the segment
+    // pierces it, otherwise attained at an end point or against an edge
+    static float SegmentTriangleDistance2(const glm::vec3& a, const glm::vec3& b, const Triangle& t) {
+        const glm::vec3 dir = b - a;
+        if (RayTriangle(a, dir, t, 1.0f) < 1.0f)
+            return 0;
+        const glm::vec3 pa = ClosestPoint(a, t) - a;
+        const glm::vec3 pb = ClosestPoint(b, t) - b;
+        float best = std::min(glm::dot(pa, pa), glm::dot(pb, pb));
+        best = std::min(best, SegmentSegmentDistance2(a, b, t.A, t.B));
+        best = std::min(best, SegmentSegmentDistance2(a, b, t.B, t.C));
+        best = std::min(best, SegmentSegmentDistance2(a, b, t.C, t.A));
+        return best;
+    }
+
+    // Ericson, Real-Time Collision Detection 5.1.9
+    static float SegmentSegmentDistance2(const glm::vec3& p1, const glm::vec3& q1, const glm::vec3& p2, const glm::vec3& q2) {
+        const glm::vec3 d1 = q1 - p1;
+        const glm::vec3 d2 = q2 - p2;
+        const glm::vec3 r = p1 - p2;
+        const float a = glm::dot(d1, d1);
+        const float e = glm::dot(d2, d2);
+        const float f = glm::dot(d2, r);
+        float s = 0;
+        float t = 0;
+        if (a <= 1e-12f && e <= 1e-12f) {
+            return glm::dot(r, r);
+        }
+        if (a <= 1e-12f) {
+            t = std::min(std::max(f / e, 0.0f), 1.0f);
+        }
+        else {
+            const float c = glm::dot(d1, r);
+            if (e <= 1e-12f) {
+                s = std::min(std::max(-c / a, 0.0f), 1.0f);
+            }
+            else {
+                const float b = glm::dot(d1, d2);
+                const float denom = a * e - b * b;
+                s = denom != 0 ? std::min(std::max((b * f - c * e) / denom, 0.0f), 1.0f) : 0.0f;
+                t = (b * s + f) / e;
+                if (t < 0) {
+                    t = 0;
+                    s = std::min(std::max(-c / a, 0.0f), 1.0f);
+                }
+                else if (t > 1) {
+                    t = 1;
+                    s = std::min(std::max((b - c) / a, 0.0f), 1.0f);
+                }
+            }
+        }
+        const glm::vec3 d = (p1 + d1 * s) - (p2 + d2 * t);
+        return glm::dot(d, d);
+    }
+
+    // Closest point on a triangle (Ericson, Real-Time Collision Detection 5.1.5)
+    static glm::vec3 ClosestPoint(const glm::vec3& p, const Triangle& t) {
+        const glm::vec3 ab = t.B - t.A;
+        const glm::vec3 ac = t.C - t.A;
+        const glm::vec3 ap = p - t.A;
+        const float d1 = glm::dot(ab, ap);
+        const float d2 = glm::dot(ac, ap);
+        if (d1 <= 0 && d2 <= 0)
+            return t.A;
+        const glm::vec3 bp = p - t.B;
+        const float d3 = glm::dot(ab, bp);
+        const float d4 = glm::dot(ac, bp);
+        if (d3 >= 0 && d4 <= d3)
+            return t.B;
+        const float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0)
+            return t.A + ab * (d1 / (d1 - d3));
+        const glm::vec3 cp = p - t.C;
+        const float d5 = glm::dot(ab, cp);
+        const float d6 = glm::dot(ac, cp);
+        if (d6 >= 0 && d5 <= d6)
+            return t.C;
+        const float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0)
+            return t.A + ac * (d2 / (d2 - d6));
+        const float va = d3 * d6 - d5 * d4;
+        if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+            return t.B + (t.C - t.B) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+        const float denom = 1.0f / (va + vb + vc);
+        return t.A + ab * (vb * denom) + ac * (vc * denom);
+    }
+
+    std::vector<Triangle> triangles_;
+    std::vector<glm::vec3> centroids_;
+    std::vector<Node> nodes_;
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "gl_resources.hpp"
+
+// Offscreen color + depth target the scene is drawn into at a fraction of the
+// window size, optionally multisampled. Present() resolves it and stretches it
+// over the window; anything drawn after that (the HUD) is at full resolution.
+class SceneTarget {
+public:
+    void Resize(int width, int height, int samples) {
+        if (width == width_ && height == height_ && samples == samples_)
+            return;
+        width_ = width;
+        height_ = height;
+        samples_ = samples;
+
+        scene_ = Create(samples, color_, depth_, true);
+        if (samples > 1)
+            resolve_ = Create(1, resolve_color_, resolve_depth_, false);
+        else
+            resolve_.Reset();
+    }
+
+    void Bind() const {
+        glBindFramebuffer(GL_FRAMEBUFFER, scene_.Get());
+        glViewport(0, 0, width_, height_);
+    }
+
+    // Leaves the window framebuffer bound with a full size viewport
+    void Present(int window_width, int window_height) const {
+        GLuint source = scene_.Get();
+        if (samples_ > 1) {
+            // Multisampled buffers can only be resolved into one of the same size
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, scene_.Get());
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolve_.Get());
+            glBlitFramebuffer(0, 0, width_, height_, 0, 0, width_, height_, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            source = resolve_.Get();
+        }
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, source);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, width_, height_, 0, 0, window_width, window_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, window_width, window_height);
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+private:
+    GLHandle<GLKind::Framebuffer> Create(int samples, GLHandle<GLKind::Renderbuffer>& color, GLHandle<GLKind::Renderbuffer>& depth, bool with_depth) {
+        auto framebuffer = GLHandle<GLKind::Framebuffer>::Create();
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.Get());
+
+        color = GLHandle<GLKind::Renderbuffer>::Create();
+        glBindRenderbuffer(GL_RENDERBUFFER, color.Get());
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples > 1 ? samples : 0, GL_RGBA8, width_, height_);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color.Get());
+
+        depth.Reset();
+        if (with_depth) {
+            depth = GLHandle<GLKind::Renderbuffer>::Create();
+            glBindRenderbuffer(GL_RENDERBUFFER, depth.Get());
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples > 1 ? samples : 0, GL_DEPTH_COMPONENT24, width_, height_);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth.Get());
+        }
+
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            fprintf(stderr, "Scene framebuffer %dx%d with %d samples is incomplete\n", width_, height_, samples);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return framebuffer;
+    }
+
+    int width_ = 0;
+    int height_ = 0;
+    int samples_ = 0;
+    GLHandle<GLKind::Framebuffer> scene_;
+    GLHandle<GLKind::Renderbuffer> color_;
+    GLHandle<GLKind::Renderbuffer> depth_;
+    GLHandle<GLKind::Framebuffer> resolve_;
+    GLHandle<GLKind::Renderbuffer> resolve_color_;
+    GLHandle<GLKind::Renderbuffer> resolve_depth_;
+};
+
+// Picks the scene resolution and MSAA level from measured GPU frame time.
+// Times come from GL_TIME_ELAPSED queries read back kLatency frames later, so
+// measuring never waits on the GPU. Each query is tagged with the level it was
+// rendered at and only results for the current level are judged; the first few
+// frames after a change are dropped too, since they pay for reallocating the
+// targets. Quality drops as soon as the smoothed time is over budget and only
+// rises again after a run of frames well under it, a longer run each time the
+// higher level turned out not to fit.
+class ResolutionController {
+public:
+    struct Level {
+        float Scale;
+        int Samples;
+    };
+
+    ResolutionController(double budget_ms, int max_samples) : budget_ms_(budget_ms) {
+        for (auto& level : std::vector<Level>{ { 1.0f, 4 }, { 1.0f, 2 }, { 1.0f, 1 }, { 0.85f, 1 }, { 0.7f, 1 }, { 0.6f, 1 }, { 0.5f, 1 } })
+            if (level.Samples <= std::max(max_samples, 1))
+                levels_.push_back(level);
+        for (auto& query : queries_)
+            query.Query = GLHandle<GLKind::Query>::Create();
+    }
+
+    // Call before Current(), so the frame is drawn at the level its query is tagged with
+    void BeginFrame() {
+        Collect();
+        auto& slot = queries_[frame_ % kLatency];
+        slot.Epoch = epoch_;
+        slot.Issued = true;
+        glBeginQuery(GL_TIME_ELAPSED, slot.Query.Get());
+    }
+
+    void EndFrame() {
+        glEndQuery(GL_TIME_ELAPSED);
+        ++frame_;
+    }
+
+    const Level& Current() const {
+        return levels_[level_];
+    }
+
+    double SmoothedMs() const {
+        return smoothed_ms_;
+    }
+
+    size_t Changes = 0;
+
+private:
+    static constexpr int kLatency = 4;
+    static constexpr int kSettleFrames = 4;
+    static constexpr int kFramesBeforeRaise = 60;
+
+    struct Slot {
+        GLHandle<GLKind::Query> Query;
+        size_t Epoch = 0;
+        bool Issued = false;
+    };
+
+    // Reads the query issued kLatency frames ago, whose slot is about to be reused
+    void Collect() {
+        auto& slot = queries_[frame_ % kLatency];
+        if (!slot.Issued)
+            return;
+        slot.Issued = false;
+        GLint available = 0;
+        glGetQueryObjectiv(slot.Query.Get(), GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available || slot.Epoch != epoch_)
+            return;
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(slot.Query.Get(), GL_QUERY_RESULT, &ns);
+        const double ms = ns / 1e6;
+        if (++samples_ <= kSettleFrames)
+            return;
+        smoothed_ms_ = samples_ == kSettleFrames + 1 ? ms : smoothed_ms_ * 0.9 + ms * 0.1;
+
+        const auto before = level_;
+        if (smoothed_ms_ > budget_ms_ && level_ + 1 < levels_.size()) {
+            // A raise that does not hold waits twice as long before the next try
+            raise_wait_ = raised_ && samples_ == kSettleFrames + 1 ? std::min(raise_wait_ * 2, kFramesBeforeRaise * 16) : kFramesBeforeRaise;
+            ++level_;
+            under_budget_ = 0;
+        }
+        else if (smoothed_ms_ < budget_ms_ * 0.7 && level_ > 0) {
+            if (++under_budget_ >= raise_wait_) {
+                --level_;
+                under_budget_ = 0;
+            }
+        }
+        else {
+            under_budget_ = 0;
+        }
+        if (level_ != before) {
+            ++Changes;
+            raised_ = level_ < before;
+            // Queries still in flight were drawn at the old level; the average
+            // is kept for the HUD and reseeded by the first sample that is not
+            ++epoch_;
+            samples_ = 0;
+            printf("dynres: frame %zu, gpu %.2f ms (smoothed %.2f, budget %.2f) -> scale %.2f, %dx MSAA\n",
+                frame_, ms, smoothed_ms_, budget_ms_, levels_[level_].Scale, levels_[level_].Samples);
+        }
+    }
+
+    double budget_ms_;
+    std::vector<Level> levels_;
+    size_t level_ = 0;
+    size_t epoch_ = 0;
+    int samples_ = 0;
+    int under_budget_ = 0;
+    int raise_wait_ = kFramesBeforeRaise;
+    bool raised_ = false;
+    size_t frame_ = 0;
+    double smoothed_ms_ = 0;
+    Slot queries_[kLatency];
+};
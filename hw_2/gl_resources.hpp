@@ -0,0 +1,343 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/objloader.hpp>
+#include <common/shader.hpp>
+#include <common/texture.hpp>
+
+#include "../shared/primitives.hpp"
+#include "bvh.hpp"
+#include "texture_streamer.hpp"
+
+enum class GLKind {
+    Buffer,
+    Texture,
+    Program,
+    VertexArray,
+    Framebuffer,
+    Renderbuffer,
+    Query,
+};
+
+// GL names whose owners are gone but which may still be referenced by commands
+// the GPU has not executed yet. They are grouped per frame behind a fence and
+// deleted only once that fence has signalled.
+class GLGarbage {
+public:
+    void Defer(GLKind kind, GLuint id) {
+        current_.push_back({ kind, id });
+    }
+
+    // Call once per frame after the last draw
+    void EndFrame() {
+        if (!current_.empty()) {
+            fenced_.push_back({ glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), std::move(current_) });
+            current_.clear();
+        }
+        while (!fenced_.empty()) {
+            auto status = glClientWaitSync(fenced_.front().first, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                break;
+            DeleteFront();
+        }
+    }
+
+    // Deletes everything right away; the context must still be current
+    void Flush() {
+        glFinish();
+        while (!fenced_.empty())
+            DeleteFront();
+        for (auto& p : current_)
+            Delete(p);
+        current_.clear();
+    }
+
+private:
+    struct Pending {
+        GLKind Kind;
+        GLuint Id;
+    };
+
+    void DeleteFront() {
+        glDeleteSync(fenced_.front().first);
+        for (auto& p : fenced_.front().second)
+            Delete(p);
+        fenced_.pop_front();
+    }
+
+    static void Delete(Pending& p) {
+        switch (p.Kind) {
+        case GLKind::Buffer: glDeleteBuffers(1, &p.Id); break;
+        case GLKind::Texture: glDeleteTextures(1, &p.Id); break;
+        case GLKind::Program: glDeleteProgram(p.Id); break;
+        case GLKind::VertexArray: glDeleteVertexArrays(1, &p.Id); break;
+        case GLKind::Framebuffer: glDeleteFramebuffers(1, &p.Id); break;
+        case GLKind::Renderbuffer: glDeleteRenderbuffers(1, &p.Id); break;
+        case GLKind::Query: glDeleteQueries(1, &p.Id); break;
+        }
+    }
+
+    std::vector<Pending> current_;
+    std::deque<std::pair<GLsync, std::vector<Pending>>> fenced_;
+};
+
+inline GLGarbage& Garbage() {
+    static GLGarbage garbage;
+    return garbage;
+}
+
+// Move-only owner of one GL name. Destruction hands the name to Garbage()
+// instead of deleting it on the spot.
+template <GLKind Kind>
+class GLHandle {
+public:
+    GLHandle() = default;
+    explicit GLHandle(GLuint id) : id_(id) { }
+    GLHandle(const GLHandle&) = delete;
+    GLHandle& operator=(const GLHandle&) = delete;
+    GLHandle(GLHandle&& o) noexcept : id_(o.Release()) { }
+    GLHandle& operator=(GLHandle&& o) noexcept {
+        if (this != &o)
+            Reset(o.Release());
+        return *this;
+    }
+    ~GLHandle() {
+        Reset();
+    }
+
+    static GLHandle Create() {
+        GLuint id = 0;
+        switch (Kind) {
+        case GLKind::Buffer: glGenBuffers(1, &id); break;
+        case GLKind::Texture: glGenTextures(1, &id); break;
+        case GLKind::Program: id = glCreateProgram(); break;
+        case GLKind::VertexArray: glGenVertexArrays(1, &id); break;
+        case GLKind::Framebuffer: glGenFramebuffers(1, &id); break;
+        case GLKind::Renderbuffer: glGenRenderbuffers(1, &id); break;
+        case GLKind::Query: glGenQueries(1, &id); break;
+        }
+        return GLHandle(id);
+    }
+
+    GLuint Get() const {
+        return id_;
+    }
+
+    GLuint Release() {
+        auto id = id_;
+        id_ = 0;
+        return id;
+    }
+
+    void Reset(GLuint id = 0) {
+        if (id_ != 0)
+            Garbage().Defer(Kind, id_);
+        id_ = id;
+    }
+
+private:
+    GLuint id_ = 0;
+};
+
+struct MeshData {
+    std::vector<glm::vec3> Vertices;
+    std::vector<glm::vec2> Uvs;
+    std::vector<glm::vec3> Normals;
+
+    GLHandle<GLKind::Buffer> VertexBuffer;
+    GLHandle<GLKind::Buffer> UvBuffer;
+    GLHandle<GLKind::Buffer> NormalBuffer;
+
+    // For collisions: radius of the bounding sphere around the model origin
+    // and the triangles in model space
+    float Radius = 0;
+    Bvh Tree;
+
+    size_t GpuBytes() const {
+        if (!VertexBuffer.Get())
+            return 0;
+        return Vertices.size() * sizeof(glm::vec3) + Uvs.size() * sizeof(glm::vec2) + Normals.size() * sizeof(glm::vec3);
+    }
+};
+
+struct TextureData {
+    GLHandle<GLKind::Texture> Id;
+    // Measured at load; streamed textures gain and lose levels after that
+    size_t Bytes = 0;
+    // Set when the mip levels are streamed
+    std::shared_ptr<StreamedTexture> Streamed;
+
+    size_t GpuBytes() const {
+        return Streamed ? Streamed->ResidentBytes() : Bytes;
+    }
+};
+
+struct ProgramData {
+    GLHandle<GLKind::Program> Id;
+};
+
+// loadOBJ negates V (the orientation loadDDS textures come in), so generated
+// meshes get their UVs flipped the same way wherever they are uploaded and draw
+// exactly like the .obj files they replace
+inline glm::vec2 LoadedUv(const primitives::Vertex& v) {
+    return glm::vec2(v.Uv[0], -v.Uv[1]);
+}
+
+// Loads every mesh, texture and program once per file name and hands out shared
+// references, so object types using the same asset share one GPU copy. The GL
+// objects go away (deferred, see GLGarbage) when the last user drops them.
+class ResourceRegistry {
+public:
+    // With a streamer, .dds files have their mip levels streamed
+    explicit ResourceRegistry(TextureStreamer* streamer = nullptr) : streamer_(streamer) { }
+
+    // upload == false keeps the mesh on the CPU only, for the headless modes
+    std::shared_ptr<const MeshData> LoadMesh(const std::string& file, bool upload = true) {
+        return Find(meshes_, file, [&] {
+            auto mesh = std::make_shared<MeshData>();
+            loadOBJ(file.c_str(), mesh->Vertices, mesh->Uvs, mesh->Normals);
+            Finish(*mesh, upload);
+            return mesh;
+        });
+    }
+
+    // Generated meshes (shared/primitives.hpp) are cached under a name of their
+    // own; the indexed data is expanded to the triangle lists everything draws
+    template <size_t V, size_t I>
+    std::shared_ptr<const MeshData> LoadMesh(const std::string& name, const primitives::Mesh<V, I>& primitive, bool upload = true) {
+        return Find(meshes_, name, [&] {
+            auto mesh = std::make_shared<MeshData>();
+            mesh->Vertices.reserve(I);
+            mesh->Uvs.reserve(I);
+            mesh->Normals.reserve(I);
+            for (auto index : primitive.Indices) {
+                auto& v = primitive.Vertices[index];
+                mesh->Vertices.emplace_back(v.Position[0], v.Position[1], v.Position[2]);
+                mesh->Uvs.push_back(LoadedUv(v));
+                mesh->Normals.emplace_back(v.Normal[0], v.Normal[1], v.Normal[2]);
+            }
+            Finish(*mesh, upload);
+            return mesh;
+        });
+    }
+
+    // .dds files go through loadDDS (or the streamer), everything else is treated as a BMP
+    std::shared_ptr<const TextureData> LoadTexture(const std::string& file) {
+        return Find(textures_, file, [&] {
+            auto texture = std::make_shared<TextureData>();
+            const bool dds = file.size() > 4 && (file.compare(file.size() - 4, 4, ".dds") == 0 || file.compare(file.size() - 4, 4, ".DDS") == 0);
+            if (dds && streamer_) {
+                texture->Id = GLHandle<GLKind::Texture>::Create();
+                texture->Streamed = streamer_->Open(file, texture->Id.Get());
+            }
+            if (!texture->Streamed)
+                texture->Id.Reset(dds ? loadDDS(file.c_str()) : loadBMP_custom(file.c_str()));
+            texture->Bytes = TextureBytes(texture->Id.Get());
+            ++uploads_;
+            uploaded_bytes_ += texture->Bytes;
+            return texture;
+        });
+    }
+
+    std::shared_ptr<const ProgramData> LoadProgram(const std::string& vertex, const std::string& fragment) {
+        return Find(programs_, vertex + '|' + fragment, [&] {
+            auto program = std::make_shared<ProgramData>();
+            program->Id.Reset(LoadShaders(vertex.c_str(), fragment.c_str()));
+            return program;
+        });
+    }
+
+    void PrintStats() const {
+        size_t mesh_bytes = 0;
+        size_t texture_bytes = 0;
+        for (auto& m : meshes_)
+            if (auto mesh = m.second.lock())
+                mesh_bytes += mesh->GpuBytes();
+        for (auto& t : textures_)
+            if (auto texture = t.second.lock())
+                texture_bytes += texture->GpuBytes();
+        printf("resources: %zu meshes, %zu textures, %zu programs, %zu cache hits\n",
+            meshes_.size(), textures_.size(), programs_.size(), cache_hits_);
+        printf("uploads: %zu (%.2f MiB), resident: meshes %.2f MiB, textures %.2f MiB\n",
+            uploads_, uploaded_bytes_ / 1048576.0, mesh_bytes / 1048576.0, texture_bytes / 1048576.0);
+    }
+
+private:
+    template <class T, class Make>
+    std::shared_ptr<const T> Find(std::unordered_map<std::string, std::weak_ptr<T>>& cache, const std::string& key, Make make) {
+        if (auto found = cache[key].lock()) {
+            ++cache_hits_;
+            return found;
+        }
+        auto created = make();
+        cache[key] = created;
+        return created;
+    }
+
+    void Finish(MeshData& mesh, bool upload) {
+        for (auto& v : mesh.Vertices)
+            mesh.Radius = std::max(mesh.Radius, glm::length(v));
+        mesh.Tree = Bvh(mesh.Vertices);
+        if (upload) {
+            mesh.VertexBuffer = Upload(mesh.Vertices);
+            mesh.UvBuffer = Upload(mesh.Uvs);
+            mesh.NormalBuffer = Upload(mesh.Normals);
+        }
+    }
+
+    template <class V>
+    GLHandle<GLKind::Buffer> Upload(const std::vector<V>& data) {
+        auto buffer = GLHandle<GLKind::Buffer>::Create();
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.Get());
+        glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(V), data.data(), GL_STATIC_DRAW);
+        ++uploads_;
+        uploaded_bytes_ += data.size() * sizeof(V);
+        return buffer;
+    }
+
+    // Sums the storage of all mip levels as reported by the driver; a streamed
+    // texture has no fine levels at first
+    static size_t TextureBytes(GLuint id) {
+        size_t bytes = 0;
+        glBindTexture(GL_TEXTURE_2D, id);
+        for (auto level = 0; level < 16; ++level) {
+            GLint width = 0;
+            GLint height = 0;
+            GLint compressed = 0;
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &width);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &height);
+            if (width == 0)
+                continue;
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED, &compressed);
+            if (compressed) {
+                GLint size = 0;
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+                bytes += size;
+            }
+            else {
+                bytes += size_t(width) * height * 4;
+            }
+        }
+        return bytes;
+    }
+
+    std::unordered_map<std::string, std::weak_ptr<MeshData>> meshes_;
+    std::unordered_map<std::string, std::weak_ptr<TextureData>> textures_;
+    std::unordered_map<std::string, std::weak_ptr<ProgramData>> programs_;
+    TextureStreamer* streamer_;
+    size_t uploads_ = 0;
+    size_t uploaded_bytes_ = 0;
+    size_t cache_hits_ = 0;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "../shared/primitives.hpp"
+#include "gl_resources.hpp"
+#include "object.hpp"
+#include "stream_buffer.hpp"
+
+// Draws every fireball with one instanced call (--gpu-fireballs). Each frame a
+// transform feedback pass with rasterization off displaces the shared sphere by
+// the noise texture, once instead of once per ball, and the draw puts that
+// sphere at each ball's position. It uses the indexed primitive rather than the
+// triangle list the CPU path draws, so the displacement runs per unique vertex
+// and the draw's vertex shader runs are cut by the post-transform cache.
+//
+// Simulate() stays the only place balls move: their positions are streamed as
+// per-instance attributes, 12 bytes a ball, through the frame's StreamBuffer,
+// so what is drawn is exactly what collides and what the journal replays.
+class GpuFireballs {
+public:
+    // meta supplies the textures and scale, mesh the sphere (kFireballMesh)
+    template <size_t V, size_t I>
+    GpuFireballs(ResourceRegistry& registry, const MetaObject& meta, const primitives::Mesh<V, I>& mesh) :
+        meta_(meta),
+        draw_program_(registry.LoadProgram("FireInstanced.vertexshader", "FireTextureFragmentShader.fragmentshader")),
+        displace_program_(LoadFeedbackProgram("FireDisplace.vertexshader", "displacedPosition")),
+        vertices_(GLHandle<GLKind::Buffer>::Create()),
+        indices_(GLHandle<GLKind::Buffer>::Create()),
+        displaced_(GLHandle<GLKind::Buffer>::Create()),
+        vertex_count_(V),
+        index_count_(I)
+    {
+        std::vector<primitives::Vertex> vertices(mesh.Vertices.begin(), mesh.Vertices.end());
+        for (auto& v : vertices)
+            v.Uv[1] = LoadedUv(v)[1];
+        glBindBuffer(GL_ARRAY_BUFFER, vertices_.Get());
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(primitives::Vertex), vertices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, indices_.Get());
+        glBufferData(GL_ARRAY_BUFFER, sizeof(mesh.Indices), mesh.Indices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, displaced_.Get());
+        glBufferData(GL_ARRAY_BUFFER, V * sizeof(glm::vec3), nullptr, GL_STREAM_COPY);
+
+        const GLuint draw = draw_program_->Id.Get();
+        draw_vp_ = glGetUniformLocation(draw, "VP");
+        draw_scale_ = glGetUniformLocation(draw, "scale");
+        draw_itime_ = glGetUniformLocation(draw, "itime");
+        draw_texture_ = glGetUniformLocation(draw, "myTextureSampler");
+        displace_itime_ = glGetUniformLocation(displace_program_.Get(), "itime");
+        displace_noise_ = glGetUniformLocation(displace_program_.Get(), "noiseTex");
+    }
+
+    // With the rest of the frame's data, before stream.Flush(). Balls holds
+    // pointers to anything with a glm::vec3 Position (the game's Fireball).
+    template <class Balls>
+    void Stage(StreamBuffer& stream, const Balls& balls) {
+        instances_ = 0;
+        if (balls.empty())
+            return;
+        auto allocation = stream.Allocate(balls.size() * sizeof(glm::vec3));
+        if (!allocation.Data)
+            return;
+        auto positions = static_cast<glm::vec3*>(allocation.Data);
+        for (auto& ball : balls)
+            *positions++ = ball->Position;
+        offset_ = allocation.Offset;
+        instances_ = GLsizei(balls.size());
+        UploadBytes += balls.size() * sizeof(glm::vec3);
+    }
+
+    // Displaces the sphere for this frame
+    void Update(float itime) {
+        glEnable(GL_RASTERIZER_DISCARD);
+        glUseProgram(displace_program_.Get());
+        glUniform1f(displace_itime_, itime);
+        glUniform1i(displace_noise_, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, meta_.Textures.at("Noise")->Id.Get());
+        BindAttribute(0, vertices_.Get(), 3, sizeof(primitives::Vertex), offsetof(primitives::Vertex, Position));
+        BindAttribute(1, vertices_.Get(), 2, sizeof(primitives::Vertex), offsetof(primitives::Vertex, Uv));
+        BindAttribute(2, vertices_.Get(), 3, sizeof(primitives::Vertex), offsetof(primitives::Vertex, Normal));
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, displaced_.Get());
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, vertex_count_);
+        glEndTransformFeedback();
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+        glDisable(GL_RASTERIZER_DISCARD);
+    }
+
+    void Draw(const StreamBuffer& stream, const glm::mat4& view_projection, float itime) {
+        if (instances_ == 0)
+            return;
+        glUseProgram(draw_program_->Id.Get());
+        glUniformMatrix4fv(draw_vp_, 1, GL_FALSE, &view_projection[0][0]);
+        glUniform1f(draw_scale_, meta_.Scale[0][0]);
+        glUniform1f(draw_itime_, itime);
+        glUniform1i(draw_texture_, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, meta_.Textures.at("Fire")->Id.Get());
+        BindAttribute(0, displaced_.Get(), 3);
+        BindAttribute(1, vertices_.Get(), 2, sizeof(primitives::Vertex), offsetof(primitives::Vertex, Uv));
+        glDisableVertexAttribArray(2);
+        BindAttribute(3, stream.Id(), 3, 0, offset_);
+        glVertexAttribDivisor(3, 1);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_.Get());
+        glDrawElementsInstanced(GL_TRIANGLES, index_count_, GL_UNSIGNED_SHORT, (void*)0, instances_);
+        // Nothing else in the shared vertex array is indexed
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glVertexAttribDivisor(3, 0);
+        glDisableVertexAttribArray(3);
+    }
+
+    size_t UploadBytes = 0;
+
+private:
+    static void BindAttribute(GLuint attribute, GLuint buffer, GLint size, GLsizei stride = 0, size_t offset = 0) {
+        glEnableVertexAttribArray(attribute);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glVertexAttribPointer(attribute, size, GL_FLOAT, GL_FALSE, stride, (void*)offset);
+    }
+
+    // LoadShaders links straight away, before the captured output can be named,
+    // so the feedback program is built here
+    static GLHandle<GLKind::Program> LoadFeedbackProgram(const char* vertex_file, const char* varying) {
+        std::ifstream in(vertex_file);
+        if (!in)
+            fprintf(stderr, "Failed to open %s\n", vertex_file);
+        const std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        const char* text = source.c_str();
+
+        const GLuint shader = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(shader, 1, &text, nullptr);
+        glCompileShader(shader);
+        auto program = GLHandle<GLKind::Program>::Create();
+        glAttachShader(program.Get(), shader);
+        glTransformFeedbackVaryings(program.Get(), 1, &varying, GL_INTERLEAVED_ATTRIBS);
+        glLinkProgram(program.Get());
+
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program.Get(), GL_LINK_STATUS, &linked);
+        if (!linked) {
+            GLint length = 0;
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+            std::vector<char> log(length + 1);
+            glGetShaderInfoLog(shader, length, nullptr, log.data());
+            printf("%s: %s\n", vertex_file, log.data());
+            glGetProgramiv(program.Get(), GL_INFO_LOG_LENGTH, &length);
+            log.assign(length + 1, 0);
+            glGetProgramInfoLog(program.Get(), length, nullptr, log.data());
+            printf("%s\n", log.data());
+        }
+        glDetachShader(program.Get(), shader);
+        glDeleteShader(shader);
+        return program;
+    }
+
+    const MetaObject& meta_;
+    std::shared_ptr<const ProgramData> draw_program_;
+    GLHandle<GLKind::Program> displace_program_;
+    // Interleaved primitives::Vertex and 16 bit indices
+    GLHandle<GLKind::Buffer> vertices_;
+    GLHandle<GLKind::Buffer> indices_;
+    // One displaced copy of the sphere's vertices, rewritten every frame
+    GLHandle<GLKind::Buffer> displaced_;
+    GLsizei vertex_count_;
+    GLsizei index_count_;
+    // This frame's ball positions in the stream
+    GLintptr offset_ = 0;
+    GLsizei instances_ = 0;
+
+    GLint draw_vp_;
+    GLint draw_scale_;
+    GLint draw_itime_;
+    GLint draw_texture_;
+    GLint displace_itime_;
+    GLint displace_noise_;
+};
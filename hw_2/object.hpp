@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "../shared/render_queue.hpp"
+#include "gl_resources.hpp"
+#include "stream_buffer.hpp"
+
+// Per object type settings; the heavy assets are shared through ResourceRegistry,
+// so a MetaObject can be freely copied.
+class MetaObject {
+public:
+    MetaObject() = default;
+    MetaObject(ResourceRegistry& registry, const char* file, bool upload = true) : Mesh(registry.LoadMesh(file, upload)) { }
+    explicit MetaObject(std::shared_ptr<const MeshData> mesh) : Mesh(std::move(mesh)) { }
+
+    std::shared_ptr<const MeshData> Mesh;
+    std::shared_ptr<const ProgramData> Program;
+    std::unordered_map<std::string, GLuint> Values;
+    std::unordered_map<std::string, std::shared_ptr<const TextureData>> Textures;
+
+    // State ids in the RenderQueue this type is drawn through
+    uint16_t ProgramKey = 0;
+    uint16_t MaterialKey = 0;
+    uint16_t MeshKey = 0;
+
+    glm::mat4 Scale;
+};
+
+// Uniform block binding point of the PerDraw block in the object shaders
+constexpr GLuint kPerDrawBinding = 0;
+
+class Object {
+public:
+    Object() = default;
+    Object(Object&&) = default;
+    Object& operator=(Object&&) = default;
+    virtual ~Object() = default;
+
+    MetaObject* meta;
+    glm::mat4 ModelMatrix;
+    GLintptr UniformOffset = -1;
+
+    // Occlusion culling state, see OcclusionCuller
+    GLintptr BoxUniformOffset = -1;
+    GLHandle<GLKind::Query> OcclusionQuery;
+    GLuint Condition = 0;
+    // OcclusionCuller frame OcclusionQuery was last issued in, 0 for never
+    size_t QueryFrame = 0;
+
+    // Writes this frame's MVP into the stream; Submit() then only refers to its range.
+    // with_box also stages the transform of the mesh's bounding box.
+    void Stage(StreamBuffer& stream, const glm::mat4& ViewProjection, bool with_box = false) {
+        glm::mat4 MVP = ViewProjection * ModelMatrix;
+        UniformOffset = Write(stream, MVP);
+        BoxUniformOffset = -1;
+        if (with_box && !meta->Mesh->Tree.Empty()) {
+            auto& root = meta->Mesh->Tree.Nodes()[0];
+            BoxUniformOffset = Write(stream, MVP * glm::translate(glm::mat4(), root.Min) * glm::scale(glm::mat4(), root.Max - root.Min));
+        }
+    }
+
+    void Submit(RenderQueue& queue) {
+        if (UniformOffset < 0)
+            return;
+        RenderQueue::Draw draw;
+        draw.Count = meta->Mesh->Vertices.size();
+        draw.UniformOffset = UniformOffset;
+        draw.Condition = Condition;
+        queue.Submit(meta->ProgramKey, meta->MaterialKey, meta->MeshKey, draw);
+    }
+
+    glm::vec3 Center() const {
+        return glm::vec3(ModelMatrix[3][0], ModelMatrix[3][1], ModelMatrix[3][2]);
+    }
+
+    // Model matrices only ever scale uniformly
+    float ScaleFactor() const {
+        return glm::length(glm::vec3(ModelMatrix[0][0], ModelMatrix[0][1], ModelMatrix[0][2]));
+    }
+
+    float BoundingRadius() const {
+        return meta->Mesh->Radius * ScaleFactor();
+    }
+
+    // Bounding spheres first; if they overlap, this object's bounding sphere is
+    // tested against the actual triangles of o, in o's model space
+    bool IsCollide(Object* o) {
+        const float reach = BoundingRadius() + o->BoundingRadius();
+        const glm::vec3 diff = Center() - o->Center();
+        if (glm::dot(diff, diff) > reach * reach)
+            return false;
+        if (o->meta->Mesh->Tree.Empty())
+            return true;
+
+        const glm::vec4 local = glm::inverse(o->ModelMatrix) * glm::vec4(Center(), 1);
+        return o->meta->Mesh->Tree.IntersectsSphere(glm::vec3(local[0], local[1], local[2]), BoundingRadius() / o->ScaleFactor());
+    }
+
+private:
+    static GLintptr Write(StreamBuffer& stream, const glm::mat4& matrix) {
+        auto allocation = stream.Allocate(sizeof(matrix));
+        if (allocation.Data)
+            memcpy(allocation.Data, &matrix[0][0], sizeof(matrix));
+        return allocation.Offset;
+    }
+
+
+};
+
+// Enemies are stored by value and balls by pointer; lets one loop take either
+inline Object& AsObject(Object& o) {
+    return o;
+}
+
+template <class T>
+Object& AsObject(const std::unique_ptr<T>& o) {
+    return *o;
+}
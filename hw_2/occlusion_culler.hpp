@@ -0,0 +1,143 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "gl_resources.hpp"
+#include "object.hpp"
+#include "stream_buffer.hpp"
+
+// Optional visibility pass for crowded scenes. Enemies are first drawn depth
+// only; then the bounding box of every enemy and ball is rasterized against that
+// depth inside an occlusion query, and the main pass of the same frame draws
+// each object conditionally on its query with GL_QUERY_WAIT (the GPU waits for
+// the answer, the CPU does not), so hidden ones are never shaded. Each object's
+// result from the previous frame is read back without waiting, for statistics
+// only; an object that was not tested last frame has no answer to read.
+class OcclusionCuller {
+public:
+    explicit OcclusionCuller(ResourceRegistry& registry) :
+        program_(registry.LoadProgram("DepthOnly.vertexshader", "DepthOnly.fragmentshader")),
+        cube_(GLHandle<GLKind::Buffer>::Create())
+    {
+        glUniformBlockBinding(program_->Id.Get(), glGetUniformBlockIndex(program_->Id.Get(), "PerDraw"), kPerDrawBinding);
+
+        // Unit cube, 12 triangles; winding does not matter, culling is off for boxes
+        std::vector<glm::vec3> cube;
+        for (auto axis = 0; axis < 3; ++axis) {
+            for (float side : { 0.0f, 1.0f }) {
+                glm::vec3 corners[4];
+                for (auto k = 0; k < 4; ++k) {
+                    corners[k][axis] = side;
+                    corners[k][(axis + 1) % 3] = float(k == 1 || k == 2);
+                    corners[k][(axis + 2) % 3] = float(k >= 2);
+                }
+                cube.insert(cube.end(), { corners[0], corners[1], corners[2], corners[0], corners[2], corners[3] });
+            }
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, cube_.Get());
+        glBufferData(GL_ARRAY_BUFFER, cube.size() * sizeof(glm::vec3), cube.data(), GL_STATIC_DRAW);
+    }
+
+    // Call once per frame, before DepthPrepass and IssueQueries
+    void BeginFrame() {
+        ++frame_;
+    }
+
+    template <class Objects>
+    void DepthPrepass(Objects& objects, const StreamBuffer& stream) {
+        glUseProgram(program_->Id.Get());
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glEnableVertexAttribArray(0);
+        for (GLuint attribute = 1; attribute < 3; ++attribute)
+            glDisableVertexAttribArray(attribute);
+        for (auto& item : objects) {
+            auto& o = AsObject(item);
+            if (o.UniformOffset < 0)
+                continue;
+            glBindBuffer(GL_ARRAY_BUFFER, o.meta->Mesh->VertexBuffer.Get());
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+            glBindBufferRange(GL_UNIFORM_BUFFER, kPerDrawBinding, stream.Id(), o.UniformOffset, sizeof(glm::mat4));
+            glDrawArrays(GL_TRIANGLES, 0, o.meta->Mesh->Vertices.size());
+        }
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    }
+
+    // Sets Condition on every object; objects whose box the camera is inside or
+    // very close to are drawn unconditionally, the near plane would clip the box
+    template <class Objects>
+    void IssueQueries(Objects& objects, const StreamBuffer& stream, const glm::vec3& camera) {
+        glUseProgram(program_->Id.Get());
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glDepthMask(GL_FALSE);
+        glDisable(GL_CULL_FACE);
+        glEnableVertexAttribArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, cube_.Get());
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        for (auto& item : objects) {
+            auto& o = AsObject(item);
+            o.Condition = 0;
+            if (!o.OcclusionQuery.Get()) {
+                o.OcclusionQuery = GLHandle<GLKind::Query>::Create();
+            }
+            else if (o.QueryFrame != 0 && o.QueryFrame + 1 == frame_) {
+                // Last frame's answer, if it is already there
+                GLint available = 0;
+                glGetQueryObjectiv(o.OcclusionQuery.Get(), GL_QUERY_RESULT_AVAILABLE, &available);
+                if (available) {
+                    GLint visible = 0;
+                    glGetQueryObjectiv(o.OcclusionQuery.Get(), GL_QUERY_RESULT, &visible);
+                    ++Tested;
+                    Skipped += visible == 0;
+                }
+            }
+            if (o.BoxUniformOffset < 0 || NearBox(o, camera)) {
+                ++Unconditional;
+                continue;
+            }
+            glBindBufferRange(GL_UNIFORM_BUFFER, kPerDrawBinding, stream.Id(), o.BoxUniformOffset, sizeof(glm::mat4));
+            glBeginQuery(GL_ANY_SAMPLES_PASSED, o.OcclusionQuery.Get());
+            glDrawArrays(GL_TRIANGLES, 0, 36);
+            glEndQuery(GL_ANY_SAMPLES_PASSED);
+            o.Condition = o.OcclusionQuery.Get();
+            o.QueryFrame = frame_;
+        }
+        glEnable(GL_CULL_FACE);
+        glDepthMask(GL_TRUE);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    }
+
+    size_t Frames() const {
+        return frame_;
+    }
+
+    // Results read back, and how many of them skipped their draw
+    size_t Tested = 0;
+    size_t Skipped = 0;
+    // Draws issued without a query
+    size_t Unconditional = 0;
+
+private:
+    // Beyond the 0.1 near plane with some room to spare
+    static constexpr float kNearMargin = 0.2f;
+
+    // Whether the camera is within kNearMargin of the box Object::Stage queries
+    // with (the root of the mesh's BVH), tested in the object's model space
+    static bool NearBox(const Object& o, const glm::vec3& camera) {
+        auto& root = o.meta->Mesh->Tree.Nodes()[0];
+        const glm::vec4 local = glm::inverse(o.ModelMatrix) * glm::vec4(camera, 1);
+        const float margin = kNearMargin / o.ScaleFactor();
+        for (auto axis = 0; axis < 3; ++axis) {
+            if (local[axis] < root.Min[axis] - margin || local[axis] > root.Max[axis] + margin)
+                return false;
+        }
+        return true;
+    }
+
+    std::shared_ptr<const ProgramData> program_;
+    GLHandle<GLKind::Buffer> cube_;
+    size_t frame_ = 0;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stddef.h>
+#include <chrono>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "gl_resources.hpp"
+
+// Ring buffer for data that is rewritten every frame (per-draw uniforms).
+// With ARB_buffer_storage the buffer is mapped once, persistently and coherently,
+// split into kFrames regions and each region is fenced after use, so the CPU only
+// waits when it laps the GPU. On plain GL 3.3 the frame is written to a staging
+// copy and uploaded by orphaning the buffer in Flush().
+class StreamBuffer {
+public:
+    static constexpr int kFrames = 3;
+
+    struct Allocation {
+        void* Data;
+        GLintptr Offset;
+    };
+
+    StreamBuffer(GLenum target, size_t frame_size, bool allow_persistent = true) :
+        target_(target),
+        frame_size_(frame_size),
+        persistent_(allow_persistent && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)),
+        buffer_(GLHandle<GLKind::Buffer>::Create())
+    {
+        GLint alignment = 1;
+        if (target == GL_UNIFORM_BUFFER)
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        alignment_ = alignment;
+
+        glBindBuffer(target_, buffer_.Get());
+        if (persistent_) {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(target_, frame_size_ * kFrames, nullptr, flags);
+            mapped_ = static_cast<char*>(glMapBufferRange(target_, 0, frame_size_ * kFrames, flags));
+        }
+        else {
+            glBufferData(target_, frame_size_, nullptr, GL_STREAM_DRAW);
+            staging_.resize(frame_size_);
+        }
+    }
+
+    StreamBuffer(const StreamBuffer&) = delete;
+    StreamBuffer& operator=(const StreamBuffer&) = delete;
+
+    ~StreamBuffer() {
+        for (auto& fence : fences_)
+            if (fence)
+                glDeleteSync(fence);
+        if (mapped_) {
+            glBindBuffer(target_, buffer_.Get());
+            glUnmapBuffer(target_);
+        }
+    }
+
+    // Waits until the region about to be reused is no longer read by the GPU
+    void BeginFrame() {
+        head_ = 0;
+        if (!persistent_)
+            return;
+        region_ = (region_ + 1) % kFrames;
+        auto& fence = fences_[region_];
+        if (!fence)
+            return;
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            ++Stalls;
+            auto start = std::chrono::steady_clock::now();
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) { }
+            StallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    // Data is nullptr when the frame budget is exhausted
+    Allocation Allocate(size_t bytes) {
+        const size_t offset = (head_ + alignment_ - 1) / alignment_ * alignment_;
+        if (offset + bytes > frame_size_) {
+            ++Overflows;
+            return { nullptr, -1 };
+        }
+        head_ = offset + bytes;
+        BytesStreamed += bytes;
+        if (persistent_)
+            return { mapped_ + region_ * frame_size_ + offset, GLintptr(region_ * frame_size_ + offset) };
+        return { staging_.data() + offset, GLintptr(offset) };
+    }
+
+    // Makes everything allocated this frame visible to the GPU; call before the draws
+    void Flush() {
+        if (persistent_ || head_ == 0)
+            return;
+        glBindBuffer(target_, buffer_.Get());
+        glBufferData(target_, frame_size_, nullptr, GL_STREAM_DRAW);
+        glBufferSubData(target_, 0, head_, staging_.data());
+    }
+
+    // Call after the last draw that reads this frame's data
+    void EndFrame() {
+        if (persistent_)
+            fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    GLuint Id() const {
+        return buffer_.Get();
+    }
+
+    bool IsPersistent() const {
+        return persistent_;
+    }
+
+    size_t BytesStreamed = 0;
+    size_t Stalls = 0;
+    size_t Overflows = 0;
+    double StallSeconds = 0;
+
+private:
+    GLenum target_;
+    size_t frame_size_;
+    size_t alignment_ = 1;
+    bool persistent_;
+    GLHandle<GLKind::Buffer> buffer_;
+    char* mapped_ = nullptr;
+    std::vector<char> staging_;
+    GLsync fences_[kFrames] = {};
+    int region_ = 0;
+    size_t head_ = 0;
+};
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Memory-mapped files, see MappedFile
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <GL/glew.h>
+
+// Read-only view of a whole file; the OS pages it in as it is read
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        Close();
+    }
+
+    bool Open(const std::string& file) {
+        Close();
+#ifdef _WIN32
+        file_ = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        if (file_ != INVALID_HANDLE_VALUE && GetFileSizeEx(file_, &size) && size.QuadPart > 0) {
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping_)
+                data_ = static_cast<const uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+            size_ = size_t(size.QuadPart);
+        }
+#else
+        const int fd = open(file.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = static_cast<const uint8_t*>(data);
+                size_ = size_t(info.st_size);
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+#endif
+        if (!data_)
+            Close();
+        return data_ != nullptr;
+    }
+
+    void Close() {
+#ifdef _WIN32
+        if (data_)
+            UnmapViewOfFile(data_);
+        if (mapping_)
+            CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_)
+            munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const uint8_t* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+};
+
+// A DDS texture whose finer mip levels come and go, see TextureStreamer
+struct StreamedTexture {
+    struct Level {
+        size_t Offset;
+        size_t Bytes;
+        GLsizei Width;
+        GLsizei Height;
+    };
+
+    MappedFile File;
+    // Owned by the TextureData this belongs to
+    GLuint Texture = 0;
+    GLenum Format = 0;
+    std::vector<Level> Levels;
+    // Finest level on the GPU, all coarser ones are there too
+    int Resident = 0;
+    // Levels from here down were uploaded at startup and are never dropped
+    int Pinned = 0;
+    // Finest level asked for in frame LastUsed
+    int Wanted = 0;
+    size_t LastUsed = 0;
+
+    size_t ResidentBytes() const {
+        size_t bytes = 0;
+        for (size_t level = Resident; level < Levels.size(); ++level)
+            bytes += Levels[level].Bytes;
+        return bytes;
+    }
+};
+
+// Streams the mip levels of DDS textures within a fixed memory budget. Open()
+// maps the file and uploads only the levels up to kStartupSize texels across.
+// Every frame the renderer reports how large the objects using each texture
+// appear on screen, and Update() uploads the next finer level of the textures
+// short of detail, straight from the mapping, up to upload_per_frame bytes a
+// frame (always at least one level). When a level does not fit the budget the
+// least recently used texture gives up its finest level first; textures drawn
+// this frame only give up detail they were not asked for.
+class TextureStreamer {
+public:
+    static constexpr GLsizei kStartupSize = 64;
+
+    TextureStreamer(size_t budget, size_t upload_per_frame = 256 << 10) :
+        budget_(budget),
+        upload_per_frame_(upload_per_frame)
+    { }
+
+    // Fills texture, an unused texture object, from a DXT1/3/5 .dds file;
+    // nullptr if the file is anything else
+    std::shared_ptr<StreamedTexture> Open(const std::string& file, GLuint texture) {
+        auto streamed = std::make_shared<StreamedTexture>();
+        if (!streamed->File.Open(file) || streamed->File.Size() < 128 || memcmp(streamed->File.Data(), "DDS ", 4) != 0)
+            return nullptr;
+
+        auto field = [&](size_t offset) {
+            uint32_t value;
+            memcpy(&value, streamed->File.Data() + offset, sizeof(value));
+            return value;
+        };
+        const uint32_t height = field(12);
+        const uint32_t width = field(16);
+        const uint32_t mip_count = std::max(field(28), 1u);
+        const char* four_cc = reinterpret_cast<const char*>(streamed->File.Data() + 84);
+        size_t block_size = 16;
+        if (memcmp(four_cc, "DXT1", 4) == 0) {
+            streamed->Format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+            block_size = 8;
+        }
+        else if (memcmp(four_cc, "DXT3", 4) == 0) {
+            streamed->Format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+        }
+        else if (memcmp(four_cc, "DXT5", 4) == 0) {
+            streamed->Format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        }
+        else {
+            return nullptr;
+        }
+
+        size_t offset = 128;
+        GLsizei w = width;
+        GLsizei h = height;
+        for (uint32_t level = 0; level < mip_count && (w > 0 || h > 0); ++level) {
+            w = std::max(w, 1);
+            h = std::max(h, 1);
+            const size_t bytes = size_t((w + 3) / 4) * ((h + 3) / 4) * block_size;
+            if (offset + bytes > streamed->File.Size())
+                break;
+            streamed->Levels.push_back({ offset, bytes, w, h });
+            offset += bytes;
+            w /= 2;
+            h /= 2;
+        }
+        if (streamed->Levels.empty())
+            return nullptr;
+
+        const int last = int(streamed->Levels.size()) - 1;
+        streamed->Texture = texture;
+        streamed->Pinned = last;
+        while (streamed->Pinned > 0 && streamed->Levels[streamed->Pinned - 1].Width <= kStartupSize && streamed->Levels[streamed->Pinned - 1].Height <= kStartupSize)
+            --streamed->Pinned;
+        streamed->Resident = streamed->Levels.size();
+        streamed->Wanted = last;
+
+        // Sampling stays within the resident levels: the base level follows
+        // Upload() and Drop(), the mipmapped filter never reaches past them
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, last);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, last);
+        for (auto level = last; level >= streamed->Pinned; --level)
+            Upload(*streamed, level);
+        StartupBytes += streamed->ResidentBytes();
+        resident_ += streamed->ResidentBytes();
+        textures_.push_back(streamed);
+        return streamed;
+    }
+
+    // pixels: on-screen size of one object drawn with the texture this frame.
+    // Takes TextureData::Streamed, nullptr for textures that are not streamed.
+    void Request(StreamedTexture* t, float pixels) {
+        if (!t)
+            return;
+        if (t->LastUsed != frame_) {
+            t->LastUsed = frame_;
+            t->Wanted = int(t->Levels.size()) - 1;
+        }
+        // Coarsest level that still has a texel per pixel
+        auto level = 0;
+        while (level + 1 < int(t->Levels.size()) && t->Levels[level + 1].Width >= pixels)
+            ++level;
+        t->Wanted = std::min(t->Wanted, level);
+    }
+
+    // Call once per frame after the requests
+    void Update() {
+        std::vector<std::shared_ptr<StreamedTexture>> live;
+        for (auto& weak : textures_)
+            if (auto t = weak.lock())
+                live.push_back(t);
+        textures_.assign(live.begin(), live.end());
+        resident_ = 0;
+        for (auto& t : live)
+            resident_ += t->ResidentBytes();
+
+        auto missing = [&](const StreamedTexture& t) {
+            return t.LastUsed == frame_ ? t.Resident - t.Wanted : 0;
+        };
+        size_t uploaded = 0;
+        while (!live.empty()) {
+            // Most levels short first
+            auto& t = **std::max_element(live.begin(), live.end(), [&](auto& a, auto& b) {
+                return missing(*a) < missing(*b);
+            });
+            if (missing(t) <= 0)
+                break;
+            const auto level = t.Resident - 1;
+            const auto bytes = t.Levels[level].Bytes;
+            if (uploaded > 0 && uploaded + bytes > upload_per_frame_)
+                break;
+            if (!MakeRoom(live, t, bytes))
+                break;
+            Upload(t, level);
+            resident_ += bytes;
+            uploaded += bytes;
+            ++Promotions;
+        }
+
+        LastFrameBytes = uploaded;
+        UploadedBytes += uploaded;
+        PeakFrameBytes = std::max(PeakFrameBytes, uploaded);
+        PeakResident = std::max(PeakResident, resident_);
+        ++frame_;
+    }
+
+    size_t ResidentBytes() const {
+        return resident_;
+    }
+
+    size_t Budget() const {
+        return budget_;
+    }
+
+    size_t StartupBytes = 0;
+    size_t UploadedBytes = 0;
+    size_t LastFrameBytes = 0;
+    size_t PeakFrameBytes = 0;
+    size_t PeakResident = 0;
+    size_t Promotions = 0;
+    size_t Evictions = 0;
+
+private:
+    // Drops levels of other textures until bytes more fit the budget
+    bool MakeRoom(const std::vector<std::shared_ptr<StreamedTexture>>& live, const StreamedTexture& keep, size_t bytes) {
+        while (resident_ + bytes > budget_) {
+            StreamedTexture* victim = nullptr;
+            for (auto& t : live) {
+                if (t.get() == &keep || t->Resident >= t->Pinned)
+                    continue;
+                if (t->LastUsed == frame_ && t->Resident >= t->Wanted)
+                    continue;
+                if (!victim || t->LastUsed < victim->LastUsed)
+                    victim = t.get();
+            }
+            if (!victim)
+                return false;
+            resident_ -= victim->Levels[victim->Resident].Bytes;
+            Drop(*victim);
+            ++Evictions;
+        }
+        return true;
+    }
+
+    // Levels are always added and dropped at the fine end, with the base level
+    // moved so the texture stays complete
+    static void Upload(StreamedTexture& t, int level) {
+        auto& l = t.Levels[level];
+        glBindTexture(GL_TEXTURE_2D, t.Texture);
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, t.Format, l.Width, l.Height, 0, GLsizei(l.Bytes), t.File.Data() + l.Offset);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+        t.Resident = level;
+    }
+
+    static void Drop(StreamedTexture& t) {
+        glBindTexture(GL_TEXTURE_2D, t.Texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, t.Resident + 1);
+        // A zero sized image releases the level's storage
+        glCompressedTexImage2D(GL_TEXTURE_2D, t.Resident, t.Format, 0, 0, 0, 0, nullptr);
+        ++t.Resident;
+    }
+
+    size_t budget_;
+    size_t upload_per_frame_;
+    size_t resident_ = 0;
+    size_t frame_ = 1;
+    std::vector<std::weak_ptr<StreamedTexture>> textures_;
+};
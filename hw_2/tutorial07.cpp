@@ -5,8 +5,20 @@
 #include <iostream>
 #include <unordered_map>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+#include <cctype>
+#include <cerrno>
+#include <limits>
+#include <iterator>
 
 // Include GLEW
 #include <GL/glew.h>
@@ -27,64 +39,16 @@ using namespace glm;
 #include <common/text2D.hpp>
 #include <memory>
 
-class MetaObject {
-public:
-    MetaObject(const char* file) {
-        loadOBJ(file, Vertices, Uvs, Normals);
-
-        glGenBuffers(1, &VertexBuffer);
-        glBindBuffer(GL_ARRAY_BUFFER, VertexBuffer);
-        glBufferData(GL_ARRAY_BUFFER, Vertices.size() * sizeof(glm::vec3), &Vertices[0], GL_STATIC_DRAW);
-
-        glGenBuffers(1, &UvBuffer);
-        glBindBuffer(GL_ARRAY_BUFFER, UvBuffer);
-        glBufferData(GL_ARRAY_BUFFER, Uvs.size() * sizeof(glm::vec2), &Uvs[0], GL_STATIC_DRAW);//GLuint enemy_uvbuffer;
-
-        glGenBuffers(1, &NormalsID);
-        glBindBuffer(GL_ARRAY_BUFFER, NormalsID);
-        glBufferData(GL_ARRAY_BUFFER, Normals.size() * sizeof(glm::vec3), &Normals[0], GL_STATIC_DRAW);
-    }
-
-    std::vector<glm::vec3> Vertices;
-    std::vector<glm::vec2> Uvs;
-    std::vector<glm::vec3> Normals;
-
-    GLuint ProgramID;
-    std::unordered_map<std::string, GLuint> Values;
-    std::unordered_map<std::string, GLuint> Textures;
-
-    GLuint VertexBuffer;
-    GLuint UvBuffer;
-    GLuint NormalsID;
-
-    mat4 Scale;
-
-    ~MetaObject() {
-        // Cleanup VBO and shader
-        glDeleteBuffers(1, &VertexBuffer);
-        glDeleteBuffers(1, &UvBuffer);
-        glDeleteBuffers(1, &NormalsID);
-        glDeleteProgram(ProgramID);
-        for (auto& texture : Textures)
-            glDeleteTextures(1, &texture.second);
-    }
-};
-
-class Object {
-public:
-    virtual ~Object() = default;
-
-    MetaObject* meta;
-    mat4 ModelMatrix;
-
-    bool IsCollide(Object* o) {
-        auto diff = ModelMatrix - o->ModelMatrix;
-        float dist = std::sqrt(std::pow(diff[3][0], 2) + std::pow(diff[3][1], 2) + std::pow(diff[3][2], 2));
-        return dist < 1.0f;
-    }
-
-
-};
+#include "../shared/render_queue.hpp"
+#include "../shared/primitives.hpp"
+#include "bvh.hpp"
+#include "bench.hpp"
+#include "gl_resources.hpp"
+#include "stream_buffer.hpp"
+#include "dynamic_resolution.hpp"
+#include "object.hpp"
+#include "occlusion_culler.hpp"
+#include "gpu_fireballs.hpp"
 
 class Enemy : public Object {
 public:
@@ -93,177 +57,373 @@ public:
         this->meta = meta;
         ModelMatrix = translate(mat4(), position);
     }
-
-    void Draw() {
-        glm::mat4 ProjectionMatrix = getProjectionMatrix();
-        glm::mat4 ViewMatrix = getViewMatrix();
-        //glm::mat4 ModelMatrix = glm::mat4(1.0);
-        glm::mat4 MVP = ProjectionMatrix * ViewMatrix * ModelMatrix;
-
-        // Send our transformation to the currently bound shader,
-        // in the "MVP" uniform
-        glUniformMatrix4fv(meta->Values["MatrixID"], 1, GL_FALSE, &MVP[0][0]);
-
-        // Bind our texture in Texture Unit 0
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, meta->Textures["Texture"]);
-        // Set our "myTextureSampler" sampler to use Texture Unit 0
-        glUniform1i(meta->Values["TextureID"], 0);
-
-        // 1rst attribute buffer : vertices
-        glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, meta->VertexBuffer);
-        glVertexAttribPointer(
-            0,                  // attribute
-            3,                  // size
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-        );
-
-        // 2nd attribute buffer : UVs
-        glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, meta->UvBuffer);
-        glVertexAttribPointer(
-            1,                                // attribute
-            2,                                // size
-            GL_FLOAT,                         // type
-            GL_FALSE,                         // normalized?
-            0,                                // stride
-            (void*)0                          // array buffer offset
-        );
-
-        // Draw the triangle !
-        glDrawArrays(GL_TRIANGLES, 0, meta->Vertices.size());
-
-        glDisableVertexAttribArray(0);
-        glDisableVertexAttribArray(1);
-    }
 };
 
+// Same positions, UVs and flat normals as sphere.obj, built by the compiler
+// instead of parsed at startup (checked against the file by --check-primitives)
+constexpr auto kFireballMesh = primitives::UvSphere<32, 16, primitives::Shading::Flat>();
+
 class Fireball : public Object {
 public:
     Fireball() = default;
-    Fireball(MetaObject* meta, vec3 forward, vec3 position) : Forward(forward), Position(position + forward), SpawnPosition(position) {
+    Fireball(MetaObject* meta, vec3 forward, vec3 position) : Forward(forward), Position(position + forward), PreviousPosition(Position), SpawnPosition(position) {
         this->meta = meta;
         ModelMatrix = translate(mat4(), forward * 0.1f);
     }
 
     bool Update(float dt) {
-        Position += Forward * kSpeed * dt;
+        PreviousPosition = Position;
+        Position += Forward * Speed * dt;
         ModelMatrix = translate(mat4(), Position) * meta->Scale;
         return std::sqrt(std::pow(Position[0] - SpawnPosition[0], 2) + std::pow(Position[1] - SpawnPosition[1], 2) + std::pow(Position[2] - SpawnPosition[2], 2)) <= 7;
     }
 
-    void Draw() {
-        glm::mat4 ProjectionMatrix = getProjectionMatrix();
-        glm::mat4 ViewMatrix = getViewMatrix();
-        //glm::mat4 ModelMatrix = glm::mat4(1.0);
-        glm::mat4 MVP = ProjectionMatrix * ViewMatrix * ModelMatrix;
-
-        // Send our transformation to the currently bound shader,
-        // in the "MVP" uniform
-        glUniformMatrix4fv(meta->Values["MatrixID"], 1, GL_FALSE, &MVP[0][0]);
-
-        // Bind our texture in Texture Unit 0
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, meta->Textures["Fire"]);
-        // Set our "myTextureSampler" sampler to use Texture Unit 0
-        glUniform1i(meta->Values["TextureID"], 0);
-
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, meta->Textures["Noise"]);
-        // Set our "myTextureSampler" sampler to use Texture Unit 0
-        glUniform1i(meta->Values["NoiseTextureID"], 1);
-
-        // 1rst attribute buffer : vertices
-        glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, meta->VertexBuffer);
-        glVertexAttribPointer(
-            0,                  // attribute
-            3,                  // size
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-        );
-
-        // 2nd attribute buffer : UVs
-        glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, meta->UvBuffer);
-        glVertexAttribPointer(
-            1,                                // attribute
-            2,                                // size
-            GL_FLOAT,                         // type
-            GL_FALSE,                         // normalized?
-            0,                                // stride
-            (void*)0                          // array buffer offset
-        );
-
-        glEnableVertexAttribArray(2);
-        glBindBuffer(GL_ARRAY_BUFFER, meta->NormalsID);
-        glVertexAttribPointer(
-            2,                                // attribute
-            3,                                // size
-            GL_FLOAT,                         // type
-            GL_FALSE,                         // normalized?
-            0,                                // stride
-            (void*)0                          // array buffer offset
-        );
-
-        // Draw the triangle !
-        glDrawArrays(GL_TRIANGLES, 0, meta->Vertices.size());
-
-        glDisableVertexAttribArray(0);
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(2);
+    // Fraction of the last Update step at which the ball first touches o, or a
+    // value above 1 if it does not. Unlike IsCollide this sees hits in the middle
+    // of a long step.
+    float TimeOfImpact(Object* o) {
+        const float radius = BoundingRadius();
+        const float reach = radius + o->BoundingRadius();
+
+        // Closest approach of the step to o's bounding sphere
+        const vec3 step = Position - PreviousPosition;
+        const float len2 = dot(step, step);
+        const float t = len2 > 0 ? glm::clamp(dot(o->Center() - PreviousPosition, step) / len2, 0.0f, 1.0f) : 0.0f;
+        const vec3 closest = PreviousPosition + step * t - o->Center();
+        if (dot(closest, closest) > reach * reach)
+            return 2.0f;
+        if (o->meta->Mesh->Tree.Empty())
+            return t;
+
+        const mat4 to_local = inverse(o->ModelMatrix);
+        const vec4 from = to_local * vec4(PreviousPosition, 1);
+        const vec4 to = to_local * vec4(Position, 1);
+        return o->meta->Mesh->Tree.SweepSphere(vec3(from[0], from[1], from[2]), vec3(to[0], to[1], to[2]), radius / o->ScaleFactor());
     }
 
     static constexpr float kSpeed = 1;
 
     const vec3 Forward;
+    float Speed = kSpeed;
     vec3 Position;
+    vec3 PreviousPosition;
     vec3 SpawnPosition;
 };
 
+// How enemies appear: every Interval seconds a wave of Burst enemies is placed
+// in a spherical shell between MinRadius and MaxRadius, as long as fewer than
+// MaxPopulation are alive and fewer than MaxSpawned have appeared in the whole
+// session (0 for no limit). The defaults are the original game's: one enemy a
+// second, 13 in total.
+struct WaveConfig {
+    double Interval = 1;
+    uint32_t Burst = 1;
+    uint32_t MaxPopulation = 13;
+    uint32_t MaxSpawned = 13;
+    float MinRadius = 2;
+    float MaxRadius = 6;
+
+    // Far more than a frame can draw; also bounds what a journal can ask for
+    static constexpr uint32_t kMaxPopulation = 1000000;
+
+    // Empty when the settings can be used, otherwise what is wrong with them
+    std::string Check() const {
+        if (!(Interval >= 0))
+            return "the interval must not be negative";
+        if (Burst == 0)
+            return "the burst must be at least 1";
+        if (Burst > kMaxPopulation || MaxPopulation > kMaxPopulation)
+            return "the burst and the population must not exceed " + std::to_string(kMaxPopulation);
+        if (!(MinRadius >= 0 && MinRadius <= MaxRadius && std::isfinite(MaxRadius)))
+            return "the radii must satisfy 0 <= min radius <= max radius";
+        return {};
+    }
+};
+
 template <class T>
 class ObjectGenerator {
 public:
-    ObjectGenerator(MetaObject& meta, std::random_device& rd) :
-        counter_(0),
-        last_spawn_time_(glfwGetTime()),
-        gen_(rd()),
-        len_distr_(2.0f, 6.0f),
+    ObjectGenerator(MetaObject& meta, unsigned seed, double start_time, const WaveConfig& config = WaveConfig()) :
+        config_(config),
+        last_spawn_time_(start_time),
+        gen_(seed),
+        len_distr_(config.MinRadius, config.MaxRadius),
         alpha_distr_(0.0f, 2 * pi<float>()),
         meta_(&meta)
     { }
-    void Spawn(size_t N, std::vector<std::unique_ptr<T>>& objects) {
-        if (counter_ < 13 && glfwGetTime() - last_spawn_time_ > N) {
-            last_spawn_time_ = glfwGetTime();
+    // time is passed in instead of polled so that a replay reproduces spawns exactly
+    void Spawn(std::vector<T>& objects, double time) {
+        const bool exhausted = config_.MaxSpawned > 0 && spawned_ >= config_.MaxSpawned;
+        if (time - last_spawn_time_ <= config_.Interval || objects.size() >= config_.MaxPopulation || exhausted)
+            return;
+        last_spawn_time_ = time;
+
+        // Draw the whole wave into one buffer first, then construct the objects in
+        // place at the end of the contiguous array
+        size_t count = std::min<size_t>(config_.Burst, config_.MaxPopulation - objects.size());
+        if (config_.MaxSpawned > 0)
+            count = std::min<size_t>(count, config_.MaxSpawned - spawned_);
+        spawned_ += count;
+        centers_.resize(count);
+        for (auto& center : centers_) {
             const double r = len_distr_(gen_);
             const double phi = alpha_distr_(gen_);
             const double psi = alpha_distr_(gen_);
-            glm::vec3 center = glm::vec3(
+            center = glm::vec3(
                 cos(phi) * sin(psi) * r,
                 sin(phi) * r,
                 cos(phi) * cos(psi) * r
             );
-            objects.emplace_back(std::make_unique<T>(meta_, center));
-            ++counter_;
         }
+        if (objects.capacity() < objects.size() + count)
+            objects.reserve(std::max(objects.size() + count, objects.capacity() * 2));
+        for (auto& center : centers_)
+            objects.emplace_back(meta_, center);
     }
 private:
-    int counter_;
+    WaveConfig config_;
+    size_t spawned_ = 0;
     double last_spawn_time_;
-    std::random_device rd_;
     std::mt19937 gen_;
     std::uniform_real_distribution<> len_distr_;
     std::uniform_real_distribution<> alpha_distr_;
+    std::vector<glm::vec3> centers_;
     MetaObject* meta_;
 };
 
-void save(std::vector<std::unique_ptr<Enemy>>& enemies,
+// Binary journal of everything that feeds the simulation: the spawn seed, wave
+// settings and --fireballs count once,
+// then one record per tick with the frame time, camera pose and input events.
+// Replaying it reproduces a session exactly without a window or a GPU.
+// Fields are written in native byte order, so journals are not portable between
+// machines of different endianness.
+struct TickRecord {
+    enum Flags : uint8_t {
+        kShoot = 1 << 0,
+        kLoad = 1 << 1,
+    };
+
+    uint32_t Tick = 0;
+    double Time = 0;
+    vec3 Position;
+    std::pair<float, float> Angels;
+    uint8_t Events = 0;
+    vec3 Forward; // only stored when kShoot is set
+    std::string Snapshot; // only stored when kLoad is set: the save file as it was loaded
+};
+
+class Journal {
+public:
+    static constexpr uint32_t kMagic = 0x4A425757; // "WWBJ"
+    static constexpr uint32_t kVersion = 6;
+
+    bool OpenWrite(const std::string& name, uint32_t seed, double start_time, const WaveConfig& waves, uint32_t fireballs) {
+        file_.open(name, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+        if (!file_)
+            return false;
+        Write(kMagic);
+        Write(kVersion);
+        Write(seed);
+        Write(start_time);
+        Write(waves);
+        Write(fireballs);
+        return bool(file_);
+    }
+
+    bool OpenRead(const std::string& name, uint32_t& seed, double& start_time, WaveConfig& waves, uint32_t& fireballs) {
+        file_.open(name, std::fstream::in | std::fstream::binary);
+        if (!file_)
+            return false;
+        file_.seekg(0, std::fstream::end);
+        size_ = size_t(file_.tellg());
+        file_.seekg(0);
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        Read(magic);
+        Read(version);
+        Read(seed);
+        Read(start_time);
+        Read(waves);
+        Read(fireballs);
+        return file_ && magic == kMagic && version == kVersion;
+    }
+
+    bool IsOpen() const {
+        return file_.is_open();
+    }
+
+    void Append(const TickRecord& r) {
+        Write(r.Tick);
+        Write(r.Time);
+        Write(r.Position);
+        Write(r.Angels.first);
+        Write(r.Angels.second);
+        Write(r.Events);
+        if (r.Events & TickRecord::kShoot)
+            Write(r.Forward);
+        if (r.Events & TickRecord::kLoad) {
+            Write(uint32_t(r.Snapshot.size()));
+            file_.write(r.Snapshot.data(), r.Snapshot.size());
+        }
+    }
+
+    // False at the end of the journal; Damaged() tells a clean end from a record
+    // that is cut short or claims more data than the file holds
+    bool Next(TickRecord& r) {
+        if (!file_ || size_t(file_.tellg()) == size_)
+            return false;
+        Read(r.Tick);
+        Read(r.Time);
+        Read(r.Position);
+        Read(r.Angels.first);
+        Read(r.Angels.second);
+        Read(r.Events);
+        if (r.Events & TickRecord::kShoot)
+            Read(r.Forward);
+        r.Snapshot.clear();
+        if (r.Events & TickRecord::kLoad) {
+            uint32_t size = 0;
+            Read(size);
+            // The length comes from the file; never allocate past its end
+            if (!file_ || size > size_ - size_t(file_.tellg())) {
+                damaged_ = true;
+                return false;
+            }
+            r.Snapshot.resize(size);
+            file_.read(&r.Snapshot[0], size);
+        }
+        damaged_ = !file_;
+        return !damaged_;
+    }
+
+    bool Damaged() const {
+        return damaged_;
+    }
+
+private:
+    template <class V>
+    void Write(const V& v) {
+        file_.write(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    template <class V>
+    void Read(V& v) {
+        file_.read(reinterpret_cast<char*>(&v), sizeof(v));
+    }
+
+    // Field by field, so the struct's padding never reaches the file
+    void Write(const WaveConfig& waves) {
+        Write(waves.Interval);
+        Write(waves.Burst);
+        Write(waves.MaxPopulation);
+        Write(waves.MaxSpawned);
+        Write(waves.MinRadius);
+        Write(waves.MaxRadius);
+    }
+
+    void Read(WaveConfig& waves) {
+        Read(waves.Interval);
+        Read(waves.Burst);
+        Read(waves.MaxPopulation);
+        Read(waves.MaxSpawned);
+        Read(waves.MinRadius);
+        Read(waves.MaxRadius);
+    }
+
+    std::fstream file_;
+    size_t size_ = 0;
+    bool damaged_ = false;
+};
+
+// An index can be reported more than once in a crowd; each goes once, and the
+// survivors are moved down in a single pass that keeps their order
+template <class T>
+void EraseAll(std::vector<T>& objects, std::vector<int>& bad) {
+    std::sort(bad.begin(), bad.end());
+    bad.erase(std::unique(bad.begin(), bad.end()), bad.end());
+    if (bad.empty())
+        return;
+    size_t kept = bad.front();
+    auto next = bad.begin();
+    for (size_t i = kept; i < objects.size(); ++i) {
+        if (next != bad.end() && size_t(*next) == i) {
+            ++next;
+            continue;
+        }
+        objects[kept++] = std::move(objects[i]);
+    }
+    objects.erase(objects.begin() + kept, objects.end());
+}
+
+// Upper bound for --fireballs, also applied to journals
+constexpr uint32_t kMaxFireballs = 100000;
+
+// Keeps `count` balls in flight for --fireballs, launched from the camera in
+// directions drawn from `gen`; replaying with the same seed relaunches them
+void TopUpFireballs(std::vector<std::unique_ptr<Fireball>>& balls,
+    size_t count,
+    std::mt19937& gen,
+    MetaObject* meta,
+    const vec3& position) {
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    while (balls.size() < count) {
+        const float a = pi<float>() * unit(gen);
+        const float y = unit(gen);
+        const float r = std::sqrt(1 - y * y);
+        balls.emplace_back(std::make_unique<Fireball>(meta, vec3(r * cos(a), y, r * sin(a)), position));
+    }
+}
+
+// One simulation step; shared by the interactive loop and the replay mode so both
+// advance the world identically.
+void Simulate(std::vector<Enemy>& objs,
+    std::vector<std::unique_ptr<Fireball>>& balls,
+    int& kills,
+    ObjectGenerator<Enemy>& gg,
+    double time,
+    float dt) {
+    std::vector<int> bad_enemys;
+    std::vector<int> bad_balls;
+
+    gg.Spawn(objs, time);
+
+    for (auto i = 0; i < balls.size(); ++i) {
+        if (!balls[i]->Update(dt))
+            bad_balls.push_back(i);
+    }
+
+    // Resolve impacts in the order they happened during the step: a ball stops at
+    // the first enemy on its path and an enemy goes to the ball that reached it first
+    struct Impact {
+        float Time;
+        int Ball;
+        int Enemy;
+    };
+    std::vector<Impact> impacts;
+    for (auto i = 0; i < balls.size(); ++i) {
+        for (auto j = 0; j < objs.size(); ++j) {
+            const float toi = balls[i]->TimeOfImpact(&objs[j]);
+            if (toi <= 1)
+                impacts.push_back({ toi, i, j });
+        }
+    }
+    std::sort(impacts.begin(), impacts.end(), [](const Impact& a, const Impact& b) { return a.Time < b.Time; });
+    std::vector<char> ball_hit(balls.size());
+    std::vector<char> enemy_hit(objs.size());
+    for (auto& impact : impacts) {
+        if (ball_hit[impact.Ball] || enemy_hit[impact.Enemy])
+            continue;
+        ball_hit[impact.Ball] = enemy_hit[impact.Enemy] = 1;
+        bad_balls.push_back(impact.Ball);
+        bad_enemys.push_back(impact.Enemy);
+        ++kills;
+    }
+
+    EraseAll(balls, bad_balls);
+    EraseAll(objs, bad_enemys);
+}
+
+void save(std::vector<Enemy>& enemies,
     std::vector<std::unique_ptr<Fireball>>& balls,
     int kills,
     std::string save_name) {
@@ -274,7 +434,7 @@ void save(std::vector<std::unique_ptr<Enemy>>& enemies,
         << pos[0] << ' ' << pos[1] << ' ' << pos[2] << '\n'
         << angels.first << ' ' << angels.second << '\n';
     for (auto& e : enemies) {
-        auto& matrix = e->ModelMatrix;
+        auto& matrix = e.ModelMatrix;
         out << matrix[3][0] << ' ' << matrix[3][1] << ' ' << matrix[3][2] << ' ';
     }
     for (auto& b : balls) {
@@ -283,12 +443,11 @@ void save(std::vector<std::unique_ptr<Enemy>>& enemies,
     }
 }
 
-void load(std::vector<std::unique_ptr<Enemy>>& enemies,
+void load(std::vector<Enemy>& enemies,
     std::vector<std::unique_ptr<Fireball>>& balls,
     int& kills,
-    std::string save_name,
+    std::istream& in,
     std::pair<MetaObject*, MetaObject*> metas) {
-    std::ifstream in(save_name, std::fstream::in);
     auto esize = 0;
     auto bsize = 0;
     in >> kills >> esize >> bsize;
@@ -300,7 +459,7 @@ void load(std::vector<std::unique_ptr<Enemy>>& enemies,
     for (auto i = 0; i < esize; ++i) {
         float x, y, z;
         in >> x >> y >> z;
-        enemies.emplace_back(std::make_unique<Enemy>(metas.first, vec3{ x, y, z }));
+        enemies.emplace_back(metas.first, vec3{ x, y, z });
     }
     for (auto i = 0; i < bsize; ++i) {
         vec3 pos;
@@ -311,9 +470,812 @@ void load(std::vector<std::unique_ptr<Enemy>>& enemies,
     }
 }
 
+void load(std::vector<Enemy>& enemies,
+    std::vector<std::unique_ptr<Fireball>>& balls,
+    int& kills,
+    std::string save_name,
+    std::pair<MetaObject*, MetaObject*> metas) {
+    std::ifstream in(save_name, std::fstream::in);
+    load(enemies, balls, kills, in, metas);
+}
+
+// Mesh and scale of the two object types, the same in every mode; the window
+// adds textures and programs on top. upload == false keeps the meshes on the
+// CPU only, for the headless modes.
+MetaObject MakeEnemyMeta(ResourceRegistry& registry, bool upload) {
+    return MetaObject(registry, "haha.obj", upload);
+}
+
+MetaObject MakeBallMeta(ResourceRegistry& registry, bool upload) {
+    MetaObject meta(registry.LoadMesh("fireball", kFireballMesh, upload));
+    meta.Scale = glm::scale(mat4(), { 0.1f, 0.1f, 0.1f });
+    return meta;
+}
+
+// What the replay and the benchmarks simulate with; nothing touches GL
+struct HeadlessAssets {
+    ResourceRegistry Registry;
+    MetaObject MetaEnemy = MakeEnemyMeta(Registry, false);
+    MetaObject MetaBall = MakeBallMeta(Registry, false);
+};
+
+// Spawns nothing, for ticking a population that is set up by hand
+ObjectGenerator<Enemy> MakeIdleGenerator(MetaObject& meta) {
+    WaveConfig no_waves;
+    no_waves.MaxPopulation = 0;
+    return ObjectGenerator<Enemy>(meta, 1337, 0, no_waves);
+}
+
+// Runs a recorded session without a window as fast as possible and prints
+// the resulting state together with the simulation throughput.
+int Replay(const std::string& journal_name) {
+    Journal journal;
+    uint32_t seed = 0;
+    double start_time = 0;
+    WaveConfig waves;
+    uint32_t fireballs = 0;
+    if (!journal.OpenRead(journal_name, seed, start_time, waves, fireballs)) {
+        fprintf(stderr, "Failed to read journal %s\n", journal_name.c_str());
+        return -1;
+    }
+    // The same rules as for the command line, a journal may be damaged or edited
+    const auto wave_error = waves.Check();
+    if (!wave_error.empty() || fireballs > kMaxFireballs) {
+        fprintf(stderr, "Journal %s has bad settings: %s\n", journal_name.c_str(),
+            wave_error.empty() ? "too many fireballs" : wave_error.c_str());
+        return -1;
+    }
+
+    HeadlessAssets assets;
+
+    std::vector<Enemy> objs;
+    std::vector<std::unique_ptr<Fireball>> balls;
+    ObjectGenerator<Enemy> gg(assets.MetaEnemy, seed, start_time, waves);
+    std::mt19937 fireball_gen(seed);
+    auto kills = 0;
+    auto last_time = start_time;
+    uint32_t ticks = 0;
+
+    auto wall_start = std::chrono::steady_clock::now();
+    TickRecord r;
+    while (journal.Next(r)) {
+        if (r.Events & TickRecord::kLoad) {
+            std::vector<Enemy> nobjs;
+            std::vector<std::unique_ptr<Fireball>> nballs;
+            std::istringstream snapshot(r.Snapshot);
+            load(nobjs, nballs, kills, snapshot, { &assets.MetaEnemy, &assets.MetaBall });
+            objs = std::move(nobjs);
+            balls = std::move(nballs);
+        }
+        if (r.Events & TickRecord::kShoot)
+            balls.emplace_back(std::make_unique<Fireball>(&assets.MetaBall, r.Forward, r.Position));
+        TopUpFireballs(balls, fireballs, fireball_gen, &assets.MetaBall, r.Position);
+
+        Simulate(objs, balls, kills, gg, r.Time, r.Time - last_time);
+        last_time = r.Time;
+        ++ticks;
+    }
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wall_start;
+    if (journal.Damaged()) {
+        fprintf(stderr, "Journal %s is damaged after %u ticks\n", journal_name.c_str(), ticks);
+        return -1;
+    }
+
+    printf("replayed %u ticks (%.2f s of game time) in %.4f s, %.0f ticks/s\n",
+        ticks, last_time - start_time, wall.count(), wall.count() > 0 ? ticks / wall.count() : 0.0);
+    printf("kills %d, enemies %zu, balls %zu\n", kills, objs.size(), balls.size());
+    return 0;
+}
+
+// Measures how long it takes to grow the population to `population` enemies in
+// waves of `burst`, and how long one simulation tick takes at that size with a
+// handful of balls in flight. No window is needed.
+int BenchSpawn(uint32_t population, uint32_t burst) {
+    if (population == 0 || burst == 0) {
+        fprintf(stderr, "--bench-spawn needs a population and a burst of at least 1\n");
+        return -1;
+    }
+    HeadlessAssets assets;
+
+    WaveConfig waves;
+    waves.Interval = 0;
+    waves.Burst = burst;
+    waves.MaxPopulation = population;
+    waves.MaxSpawned = 0;
+    ObjectGenerator<Enemy> gg(assets.MetaEnemy, 1337, 0, waves);
+
+    std::vector<Enemy> objs;
+    auto start = std::chrono::steady_clock::now();
+    auto waves_spawned = 0;
+    for (double time = 1; objs.size() < population; time += 1, ++waves_spawned)
+        gg.Spawn(objs, time);
+    std::chrono::duration<double> spawn = std::chrono::steady_clock::now() - start;
 
-int main(void)
+    std::vector<std::unique_ptr<Fireball>> balls;
+    for (auto i = 0; i < 64; ++i) {
+        const float a = 2 * pi<float>() * i / 64;
+        balls.emplace_back(std::make_unique<Fireball>(&assets.MetaBall, vec3(cos(a), 0, sin(a)), vec3(0, 0, 0)));
+    }
+    // Keep the population fixed while timing ticks
+    auto idle = MakeIdleGenerator(assets.MetaEnemy);
+    auto kills = 0;
+    const auto kTicks = 100;
+    start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < kTicks; ++i)
+        Simulate(objs, balls, kills, idle, i / 60.0, 1 / 60.0f);
+    std::chrono::duration<double> tick = std::chrono::steady_clock::now() - start;
+
+    printf("spawned %u enemies in %d waves of %u: %.4f s, %.0f enemies/s\n",
+        population, waves_spawned, burst, spawn.count(), spawn.count() > 0 ? population / spawn.count() : 0.0);
+    printf("simulation tick at that population: %.3f ms\n", tick.count() * 1000 / kTicks);
+    return 0;
+}
+
+// Shoots fast balls with long steps at a ring of enemies and counts how many
+// hits a check at the end position (IsCollide) misses compared to the swept
+// test Simulate uses, then measures the tick cost of both in a crowd. Returns
+// non-zero if the swept test lets any ball through.
+int BenchSwept() {
+    HeadlessAssets assets;
+    auto idle = MakeIdleGenerator(assets.MetaEnemy);
+
+    const auto kTargets = 12;
+    const float kSpeed = 100;
+    auto tunneled = 0;
+    for (float dt : { 1 / 240.0f, 1 / 60.0f, 1 / 20.0f, 1 / 5.0f }) {
+        auto discrete_hits = 0;
+        auto swept_hits = 0;
+        for (auto swept = 0; swept < 2; ++swept) {
+            std::vector<Enemy> objs;
+            std::vector<std::unique_ptr<Fireball>> balls;
+            for (auto i = 0; i < kTargets; ++i) {
+                const float a = 2 * pi<float>() * i / kTargets;
+                const vec3 forward(cos(a), 0, sin(a));
+                objs.emplace_back(&assets.MetaEnemy, forward * 5.0f);
+                balls.emplace_back(std::make_unique<Fireball>(&assets.MetaBall, forward, vec3(0, 0, 0)));
+                balls.back()->Speed = kSpeed;
+            }
+            auto kills = 0;
+            for (auto tick = 0; !balls.empty() && tick < 10000; ++tick) {
+                if (swept) {
+                    Simulate(objs, balls, kills, idle, tick * dt, dt);
+                    continue;
+                }
+                std::vector<std::unique_ptr<Fireball>> alive;
+                for (auto& ball : balls) {
+                    bool in_range = ball->Update(dt);
+                    bool hit = false;
+                    for (auto& obj : objs)
+                        hit = hit || ball->IsCollide(&obj);
+                    kills += hit;
+                    if (in_range && !hit)
+                        alive.push_back(std::move(ball));
+                }
+                balls = std::move(alive);
+            }
+            (swept ? swept_hits : discrete_hits) = kills;
+        }
+        tunneled += kTargets - swept_hits;
+        printf("dt %.4f s (step %.2f units): end position check %d/%d hits, swept %d/%d hits\n",
+            dt, kSpeed * dt, discrete_hits, kTargets, swept_hits, kTargets);
+    }
+
+    // Tick cost in a crowd at a high and a low tick rate
+    for (float dt : { 1 / 60.0f, 1 / 15.0f }) {
+        WaveConfig waves;
+        waves.Interval = 0;
+        waves.Burst = 2000;
+        waves.MaxPopulation = 2000;
+        waves.MaxSpawned = 0;
+        ObjectGenerator<Enemy> gg(assets.MetaEnemy, 1337, 0, waves);
+        std::vector<Enemy> objs;
+        gg.Spawn(objs, 1);
+        std::vector<std::unique_ptr<Fireball>> balls;
+        std::mt19937 gen(1337);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        for (auto i = 0; i < 256; ++i) {
+            balls.emplace_back(std::make_unique<Fireball>(&assets.MetaBall, normalize(vec3(unit(gen), unit(gen), unit(gen))), vec3(0, 0, 0)));
+            balls.back()->Speed = 10;
+        }
+        auto kills = 0;
+        const auto ticks = int(std::lround(1 / dt));
+        auto start = std::chrono::steady_clock::now();
+        for (auto tick = 0; tick < ticks; ++tick)
+            Simulate(objs, balls, kills, idle, tick * dt, dt);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("2000 enemies, 256 balls, %d ticks/s: %.3f ms per tick, %.3f ms per simulated second, %d kills\n",
+            ticks, elapsed.count() * 1000 / ticks, elapsed.count() * 1000, kills);
+    }
+    return tunneled == 0 ? 0 : 1;
+}
+
+// Builds the BVH of haha.obj and of a large synthetic mesh (a bumpy sphere with
+// about a million triangles) and measures sphere and ray query throughput against
+// them, next to a brute force loop over all triangles for the small mesh.
+int BenchBvh() {
+    auto bench = [](const char* name, const std::vector<vec3>& vertices, bool brute_force) {
+        auto start = std::chrono::steady_clock::now();
+        Bvh tree(vertices);
+        std::chrono::duration<double> build = std::chrono::steady_clock::now() - start;
+
+        float radius = 0;
+        for (auto& v : vertices)
+            radius = std::max(radius, length(v));
+
+        // Queries around the surface: ball sized spheres and rays from outside towards the middle
+        std::mt19937 gen(1337);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        const auto kQueries = 1000000;
+        std::vector<vec3> points(kQueries);
+        for (auto& p : points)
+            p = vec3(unit(gen), unit(gen), unit(gen)) * (radius * 1.2f);
+
+        auto hits = 0;
+        start = std::chrono::steady_clock::now();
+        for (auto& p : points)
+            hits += tree.IntersectsSphere(p, 0.1f);
+        std::chrono::duration<double> spheres = std::chrono::steady_clock::now() - start;
+
+        auto ray_hits = 0;
+        start = std::chrono::steady_clock::now();
+        for (auto& p : points)
+            ray_hits += tree.Raycast(p, -p, 1.0f) < 1.0f;
+        std::chrono::duration<double> rays = std::chrono::steady_clock::now() - start;
+
+        printf("%s: %zu triangles, %zu nodes, built in %.2f ms\n", name, vertices.size() / 3, tree.Nodes().size(), build.count() * 1000);
+        printf("  sphere queries: %.0f/s (%d hits), ray queries: %.0f/s (%d hits)\n",
+            kQueries / spheres.count(), hits, kQueries / rays.count(), ray_hits);
+
+        if (brute_force) {
+            // One leaf per triangle is the same test without any culling
+            std::vector<Bvh> single;
+            for (size_t i = 0; i + 2 < vertices.size(); i += 3)
+                single.emplace_back(std::vector<vec3>(vertices.begin() + i, vertices.begin() + i + 3));
+            const auto kBruteQueries = 10000;
+            start = std::chrono::steady_clock::now();
+            auto brute_hits = 0;
+            for (auto q = 0; q < kBruteQueries; ++q) {
+                for (auto& t : single) {
+                    if (t.IntersectsSphere(points[q], 0.1f)) {
+                        ++brute_hits;
+                        break;
+                    }
+                }
+            }
+            std::chrono::duration<double> brute = std::chrono::steady_clock::now() - start;
+            printf("  brute force sphere queries: %.0f/s (%d hits in the first %d)\n", kBruteQueries / brute.count(), brute_hits, kBruteQueries);
+        }
+    };
+
+    std::vector<vec3> vertices;
+    std::vector<vec2> uvs;
+    std::vector<vec3> normals;
+    loadOBJ("haha.obj", vertices, uvs, normals);
+    bench("haha.obj", vertices, true);
+
+    const auto kRings = 512;
+    const auto kSegments = 1024;
+    auto point = [&](int ring, int segment) {
+        const float theta = pi<float>() * ring / kRings;
+        const float phi = 2 * pi<float>() * segment / kSegments;
+        const float r = 3 + 0.2f * sin(theta * 17) * cos(phi * 23);
+        return vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)) * r;
+    };
+    std::vector<vec3> synthetic;
+    synthetic.reserve(kRings * kSegments * 6);
+    for (auto ring = 0; ring < kRings; ++ring) {
+        for (auto segment = 0; segment < kSegments; ++segment) {
+            const vec3 a = point(ring, segment);
+            const vec3 b = point(ring + 1, segment);
+            const vec3 c = point(ring + 1, segment + 1);
+            const vec3 d = point(ring, segment + 1);
+            synthetic.insert(synthetic.end(), { a, b, c, a, c, d });
+        }
+    }
+    bench("synthetic", synthetic, false);
+    return 0;
+}
+
+// Positions within 1e-4 of each other share a key
+uint64_t WeldKey(const vec3& p) {
+    uint64_t key = 0;
+    for (auto k = 0; k < 3; ++k)
+        key = key << 21 | (uint64_t(std::llround(p[k] * 1e4) + (1 << 20)) & 0x1FFFFF);
+    return key;
+}
+
+// Welded view of a triangle list, so meshes compare whatever their vertex
+// duplication: positions within 1e-4 of each other are one vertex
+struct Topology {
+    size_t Vertices = 0;
+    size_t Triangles = 0;
+    size_t Edges = 0;
+    // Edges with a triangle on one side only
+    size_t OpenEdges = 0;
+    // Edges whose two triangles are wound the same way round it
+    size_t FlippedEdges = 0;
+    size_t Degenerate = 0;
+    // Positive when the triangles are counter-clockwise seen from outside
+    float Volume = 0;
+    std::vector<vec3> Positions;
+
+    explicit Topology(const std::vector<vec3>& soup) {
+        std::unordered_map<uint64_t, uint32_t> welded;
+        std::vector<uint32_t> indices;
+        for (auto& p : soup) {
+            auto found = welded.emplace(WeldKey(p), uint32_t(Positions.size()));
+            if (found.second)
+                Positions.push_back(p);
+            indices.push_back(found.first->second);
+        }
+        Vertices = Positions.size();
+
+        std::unordered_map<uint64_t, uint32_t> directed;
+        for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+            const uint32_t t[3] = { indices[i], indices[i + 1], indices[i + 2] };
+            if (t[0] == t[1] || t[1] == t[2] || t[2] == t[0]) {
+                ++Degenerate;
+                continue;
+            }
+            ++Triangles;
+            for (auto e = 0; e < 3; ++e)
+                ++directed[uint64_t(t[e]) << 32 | t[(e + 1) % 3]];
+            Volume += dot(Positions[t[0]], cross(Positions[t[1]], Positions[t[2]])) / 6;
+        }
+        for (auto& edge : directed) {
+            const uint64_t reverse = edge.first << 32 | edge.first >> 32;
+            if (edge.second > 1)
+                ++FlippedEdges;
+            if (directed.count(reverse) == 0)
+                ++OpenEdges;
+            // Each interior edge shows up once per direction
+            if (edge.first < reverse || directed.count(reverse) == 0)
+                ++Edges;
+        }
+    }
+
+    // A closed, consistently wound surface with no holes
+    bool IsSphereLike() const {
+        return OpenEdges == 0 && FlippedEdges == 0 && Degenerate == 0 && Volume > 0 &&
+            long(Vertices) - long(Edges) + long(Triangles) == 2;
+    }
+
+    bool SameAs(const Topology& other) const {
+        if (Vertices != other.Vertices || Edges != other.Edges || Triangles != other.Triangles)
+            return false;
+        for (auto& p : Positions) {
+            float nearest = FLT_MAX;
+            for (auto& q : other.Positions)
+                nearest = std::min(nearest, distance(p, q));
+            if (nearest > 1e-4f)
+                return false;
+        }
+        return true;
+    }
+
+    void Print(const char* name) const {
+        printf("%s: %zu vertices, %zu edges, %zu triangles, %zu open and %zu flipped edges, %zu degenerate, volume %.4f\n",
+            name, Vertices, Edges, Triangles, OpenEdges, FlippedEdges, Degenerate, Volume);
+    }
+};
+
+// Every corner of one triangle list looked up in another by position and normal,
+// which for flat shaded meshes also picks out the face, to compare what the
+// shaders get per vertex
+struct CornerMatch {
+    size_t Corners = 0;
+    // No corner at that position with that normal
+    size_t Missing = 0;
+    size_t UvMismatches = 0;
+    // Triangles whose three corners are not a triangle of the other mesh: its
+    // quads are split along the other diagonal. Same surface, but a displaced
+    // quad folds along a different edge.
+    size_t OtherDiagonal = 0;
+
+    CornerMatch(const MeshData& expected, const MeshData& actual) {
+        std::vector<std::array<uint64_t, 3>> triangles;
+        for (size_t i = 0; i + 2 < actual.Vertices.size(); i += 3)
+            triangles.push_back(TriangleKey(actual, { i, i + 1, i + 2 }));
+        std::sort(triangles.begin(), triangles.end());
+
+        // Corner of actual each corner of expected matched
+        std::vector<size_t> matched(expected.Vertices.size(), actual.Vertices.size());
+        for (size_t i = 0; i < expected.Vertices.size(); ++i) {
+            ++Corners;
+            for (size_t j = 0; j < actual.Vertices.size() && matched[i] == actual.Vertices.size(); ++j) {
+                if (distance(expected.Vertices[i], actual.Vertices[j]) < 1e-4f && distance(expected.Normals[i], actual.Normals[j]) < 1e-3f)
+                    matched[i] = j;
+            }
+            if (matched[i] == actual.Vertices.size())
+                ++Missing;
+            else if (distance(expected.Uvs[i], actual.Uvs[matched[i]]) > 1e-4f)
+                ++UvMismatches;
+        }
+        // Keyed by the matched positions, the two files round differently
+        for (size_t i = 0; i + 2 < expected.Vertices.size(); i += 3) {
+            if (matched[i] == actual.Vertices.size() || matched[i + 1] == actual.Vertices.size() || matched[i + 2] == actual.Vertices.size())
+                continue;
+            OtherDiagonal += !std::binary_search(triangles.begin(), triangles.end(), TriangleKey(actual, { matched[i], matched[i + 1], matched[i + 2] }));
+        }
+    }
+
+    static std::array<uint64_t, 3> TriangleKey(const MeshData& mesh, std::array<size_t, 3> corners) {
+        std::array<uint64_t, 3> key = { WeldKey(mesh.Vertices[corners[0]]), WeldKey(mesh.Vertices[corners[1]]), WeldKey(mesh.Vertices[corners[2]]) };
+        std::sort(key.begin(), key.end());
+        return key;
+    }
+};
+
+// Compares the generated primitives with the .obj files they stand in for:
+// welded, the same vertices, edges and triangles at the same positions, closed
+// and wound outwards; per corner, as the shaders see them after loading, the
+// same normals and, for the sphere, UVs. Cube() gives every face the whole
+// texture where cube.obj has a cross layout, so its UVs are not compared.
+// Also times parsing sphere.obj against expanding kFireballMesh. Returns
+// non-zero on any mismatch.
+int CheckPrimitives() {
+    auto expand = [](const auto& primitive) {
+        std::vector<vec3> soup;
+        for (auto index : primitive.Indices) {
+            auto& v = primitive.Vertices[index];
+            soup.emplace_back(v.Position[0], v.Position[1], v.Position[2]);
+        }
+        return soup;
+    };
+    auto load = [](const char* file) {
+        std::vector<vec3> vertices;
+        std::vector<vec2> uvs;
+        std::vector<vec3> normals;
+        loadOBJ(file, vertices, uvs, normals);
+        return vertices;
+    };
+
+    ResourceRegistry registry;
+    auto failures = 0;
+    auto compare = [&](const char* file, const char* name, const auto& primitive, bool uvs) {
+        auto expected_mesh = registry.LoadMesh(file, false);
+        auto actual_mesh = registry.LoadMesh(name, primitive, false);
+        Topology expected(expected_mesh->Vertices);
+        Topology actual(actual_mesh->Vertices);
+        expected.Print(file);
+        actual.Print("  generated");
+        CornerMatch corners(*expected_mesh, *actual_mesh);
+        printf("  %zu corners: %zu without a generated one of the same position and normal, %zu with other UVs%s\n",
+            corners.Corners, corners.Missing, corners.UvMismatches, uvs ? "" : " (not compared)");
+        printf("  %zu triangles split along the other diagonal of their quad\n", corners.OtherDiagonal);
+        const bool ok = expected.IsSphereLike() && actual.IsSphereLike() && actual.SameAs(expected) &&
+            corners.Missing == 0 && (!uvs || corners.UvMismatches == 0);
+        printf("  %s\n", ok ? "match" : "MISMATCH");
+        failures += !ok;
+    };
+    // Both quad diagonals of a UV sphere band are the same length and Blender
+    // picks either, so sphere.obj differs from any regular split there
+    compare("sphere.obj", "fireball", kFireballMesh, true);
+    compare("cube.obj", "cube", primitives::Cube(), false);
+
+    constexpr auto kIcosphere = primitives::Icosphere<3>();
+    Topology icosphere(expand(kIcosphere));
+    icosphere.Print("icosphere<3>");
+    const bool ico_ok = icosphere.IsSphereLike() && icosphere.Vertices == kIcosphere.Vertices.size();
+    printf("  %s\n", ico_ok ? "closed and outward" : "BROKEN");
+    failures += !ico_ok;
+
+    // What the fireball mesh costs at startup either way, best of a few runs
+    // since the first parse also pays for the page cache
+    const auto kRuns = 5;
+    double parse = 1e9;
+    double generate = 1e9;
+    size_t sink = 0;
+    for (auto run = 0; run < kRuns; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        sink += load("sphere.obj").size();
+        parse = std::min(parse, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+        start = std::chrono::steady_clock::now();
+        sink += expand(kFireballMesh).size();
+        generate = std::min(generate, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    printf("fireball mesh: loadOBJ(sphere.obj) %.3f ms, generated %.3f ms (%zu vertices)\n",
+        parse * 1000, generate * 1000, sink / (2 * kRuns));
+    return failures == 0 ? 0 : 1;
+}
+
+// Micro-benchmarks of the CPU side hot paths (see bench.hpp): loading the shipped
+// meshes, collision tests one by one and all pairs, ball updates, removal from
+// the object lists and cool_save files of several sizes. No window is needed.
+// Results go to stdout and, if json_name is given, to a JSON file for tracking
+// regressions between builds.
+int BenchSuite(const std::string& json_name) {
+    HeadlessAssets assets;
+
+    // Enemies where the waves put them, balls flying out from the middle
+    std::mt19937 gen(1337);
+    std::uniform_real_distribution<float> radius_distr(2, 6);
+    std::uniform_real_distribution<float> angle_distr(0, 2 * pi<float>());
+    auto make_enemies = [&](size_t count) {
+        std::vector<Enemy> objs;
+        for (size_t i = 0; i < count; ++i) {
+            const float r = radius_distr(gen);
+            const float a = angle_distr(gen);
+            objs.emplace_back(&assets.MetaEnemy, vec3(r * cos(a), 0, r * sin(a)));
+        }
+        return objs;
+    };
+    auto make_balls = [&](size_t count) {
+        std::vector<std::unique_ptr<Fireball>> balls;
+        for (size_t i = 0; i < count; ++i) {
+            const float a = angle_distr(gen);
+            balls.emplace_back(std::make_unique<Fireball>(&assets.MetaBall, vec3(cos(a), 0, sin(a)), vec3(0, 0, 0)));
+            balls.back()->Update(radius_distr(gen) / 6);
+        }
+        return balls;
+    };
+
+    BenchmarkRunner runner;
+
+    for (auto file : { "cube.obj", "sphere.obj", "enemy.obj", "haha.obj" }) {
+        runner.Run(std::string("loadOBJ/") + file, [&](BenchmarkState& state) {
+            for (size_t i = 0; i < state.Iterations(); ++i) {
+                std::vector<vec3> vertices;
+                std::vector<vec2> uvs;
+                std::vector<vec3> normals;
+                loadOBJ(file, vertices, uvs, normals);
+                DoNotOptimize(vertices.data());
+            }
+        });
+    }
+
+    {
+        Enemy enemy(&assets.MetaEnemy, vec3(3, 0, 0));
+        // Centred on a vertex of the model, so the ball touches its surface
+        Fireball touching(&assets.MetaBall, vec3(0, 0, 0), vec3(3, 0, 0) + assets.MetaEnemy.Mesh->Vertices[0]);
+        Fireball far(&assets.MetaBall, vec3(0, 0, 0), vec3(-30, 0, 0));
+        touching.Update(0);
+        far.Update(0);
+        runner.Run("IsCollide/hit", [&](BenchmarkState& state) {
+            for (size_t i = 0; i < state.Iterations(); ++i)
+                DoNotOptimize(touching.IsCollide(&enemy));
+        });
+        runner.Run("IsCollide/miss", [&](BenchmarkState& state) {
+            for (size_t i = 0; i < state.Iterations(); ++i)
+                DoNotOptimize(far.IsCollide(&enemy));
+        });
+    }
+
+    const std::pair<size_t, size_t> crowds[] = { { 16, 16 }, { 64, 256 }, { 256, 1024 } };
+    for (auto& crowd : crowds) {
+        auto balls = make_balls(crowd.first);
+        auto objs = make_enemies(crowd.second);
+        const auto suffix = "/" + std::to_string(crowd.first) + "x" + std::to_string(crowd.second);
+        runner.Run("IsCollide/all_pairs" + suffix, [&](BenchmarkState& state) {
+            state.SetItemsPerIteration(double(balls.size() * objs.size()));
+            for (size_t i = 0; i < state.Iterations(); ++i) {
+                auto hits = 0;
+                for (auto& ball : balls)
+                    for (auto& obj : objs)
+                        hits += ball->IsCollide(&obj);
+                DoNotOptimize(hits);
+            }
+        });
+        runner.Run("TimeOfImpact/all_pairs" + suffix, [&](BenchmarkState& state) {
+            state.SetItemsPerIteration(double(balls.size() * objs.size()));
+            for (size_t i = 0; i < state.Iterations(); ++i) {
+                auto hits = 0;
+                for (auto& ball : balls)
+                    for (auto& obj : objs)
+                        hits += ball->TimeOfImpact(&obj) <= 1;
+                DoNotOptimize(hits);
+            }
+        });
+    }
+
+    for (size_t count : { 64, 4096 }) {
+        auto balls = make_balls(count);
+        runner.Run("Fireball::Update/" + std::to_string(count), [&](BenchmarkState& state) {
+            state.SetItemsPerIteration(double(balls.size()));
+            for (size_t i = 0; i < state.Iterations(); ++i) {
+                auto alive = 0;
+                for (auto& ball : balls)
+                    alive += ball->Update(1 / 60.0f);
+                DoNotOptimize(alive);
+            }
+        });
+    }
+
+    // A tenth of the list removed, with a few indices reported twice as in a crowd
+    for (size_t count : { 100, 10000 }) {
+        runner.Run("EraseAll/" + std::to_string(count), [&](BenchmarkState& state) {
+            state.SetItemsPerIteration(double(count / 10));
+            for (size_t i = 0; i < state.Iterations(); ++i) {
+                state.PauseTiming();
+                auto objs = make_enemies(count);
+                std::vector<int> bad;
+                for (size_t k = 0; k < count / 10; ++k)
+                    bad.push_back(int(gen() % count));
+                bad.push_back(bad.front());
+                state.ResumeTiming();
+                EraseAll(objs, bad);
+                DoNotOptimize(objs.data());
+                state.PauseTiming();
+                objs.clear();
+                state.ResumeTiming();
+            }
+        });
+    }
+
+    const std::string save_name = "bench_save";
+    for (size_t count : { 10, 1000, 100000 }) {
+        auto objs = make_enemies(count);
+        auto balls = make_balls(count);
+        const auto suffix = "/" + std::to_string(count);
+        runner.Run("save" + suffix, [&](BenchmarkState& state) {
+            state.SetItemsPerIteration(double(2 * count));
+            for (size_t i = 0; i < state.Iterations(); ++i)
+                save(objs, balls, 0, save_name);
+        });
+        runner.Run("load" + suffix, [&](BenchmarkState& state) {
+            state.SetItemsPerIteration(double(2 * count));
+            for (size_t i = 0; i < state.Iterations(); ++i) {
+                std::vector<Enemy> loaded_objs;
+                std::vector<std::unique_ptr<Fireball>> loaded_balls;
+                auto kills = 0;
+                load(loaded_objs, loaded_balls, kills, save_name, { &assets.MetaEnemy, &assets.MetaBall });
+                DoNotOptimize(loaded_objs.data());
+                state.PauseTiming();
+                loaded_objs.clear();
+                loaded_balls.clear();
+                state.ResumeTiming();
+            }
+        });
+    }
+    std::remove(save_name.c_str());
+
+    if (!json_name.empty()) {
+        if (!runner.WriteJson(json_name, "tutorial07 --bench-suite")) {
+            fprintf(stderr, "Failed to write %s\n", json_name.c_str());
+            return 1;
+        }
+        printf("wrote %s\n", json_name.c_str());
+    }
+    return 0;
+}
+
+const char* const kUsage =
+    "Usage: tutorial07 [--record <journal>] [--replay <journal>]\n"
+    "                  [--waves <interval> <burst> <max population> <min radius> <max radius>]\n"
+    "                  [--max-spawned <count>]\n"
+    "                  [--bench-spawn <population> <burst>] [--bench-bvh] [--bench-swept] [--no-persistent]\n"
+    "                  [--frame-budget <ms>] [--occlusion] [--check-primitives]\n"
+    "                  [--texture-budget <MiB>] [--bench-suite [<json file>]]\n"
+    "                  [--gpu-fireballs] [--fireballs <count>]\n";
+
+// Prints what is wrong with the command line and the usage; returns main's error code
+int Usage(const std::string& problem) {
+    fprintf(stderr, "%s\n%s", problem.c_str(), kUsage);
+    return -1;
+}
+
+// Command line counts. std::stoul quietly wraps "-1" around and throws on
+// anything that is not a number, so the whole argument has to be digits.
+template <class T>
+bool ParseCount(const char* text, T& value, T max = std::numeric_limits<T>::max()) {
+    char* end = nullptr;
+    errno = 0;
+    const auto parsed = std::strtoull(text, &end, 10);
+    if (!isdigit(static_cast<unsigned char>(text[0])) || *end != '\0' || errno != 0 || parsed > max)
+        return false;
+    value = T(parsed);
+    return true;
+}
+
+template <class T>
+bool ParseNumber(const char* text, T& value) {
+    char* end = nullptr;
+    const double parsed = std::strtod(text, &end);
+    if (end == text || *end != '\0' || !std::isfinite(parsed))
+        return false;
+    value = T(parsed);
+    return true;
+}
+
+// See kUsage for the flags.
+// For a software run set LIBGL_ALWAYS_SOFTWARE=1 (Mesa llvmpipe) and load the
+// scene with --waves; the chosen resolution is logged on every change.
+// --waves lifts the original 13 enemies per session unless --max-spawned sets a
+// limit (0 for none).
+// --fireballs keeps that many balls in flight for measuring; compare runs with
+// and without --gpu-fireballs.
+int main(int argc, char** argv)
 {
+    std::string record_name;
+    WaveConfig waves;
+    bool waves_given = false;
+    bool max_spawned_given = false;
+    bool allow_persistent = true;
+    double frame_budget_ms = 1000.0 / 60;
+    bool occlusion = false;
+    size_t texture_budget_mib = 0;
+    bool gpu_fireballs = false;
+    size_t stress_balls = 0;
+    for (auto i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        // Number of values the flag takes that are still on the command line
+        auto values = [&](int count) {
+            return i + count < argc;
+        };
+        if (arg == "--replay") {
+            if (!values(1))
+                return Usage("--replay needs a journal");
+            return Replay(argv[i + 1]);
+        }
+        if (arg == "--bench-spawn") {
+            uint32_t population = 0;
+            uint32_t burst = 0;
+            if (!values(2) || !ParseCount(argv[i + 1], population) || !ParseCount(argv[i + 2], burst))
+                return Usage("--bench-spawn needs a population and a burst");
+            return BenchSpawn(population, burst);
+        }
+        if (arg == "--bench-bvh")
+            return BenchBvh();
+        if (arg == "--bench-swept")
+            return BenchSwept();
+        if (arg == "--check-primitives")
+            return CheckPrimitives();
+        // The JSON file is optional, a following flag is not taken for it
+        if (arg == "--bench-suite")
+            return BenchSuite(values(1) && strncmp(argv[i + 1], "--", 2) != 0 ? argv[i + 1] : "");
+        if (arg == "--record") {
+            if (!values(1))
+                return Usage("--record needs a journal");
+            record_name = argv[++i];
+        }
+        else if (arg == "--waves") {
+            if (!values(5)
+                || !ParseNumber(argv[i + 1], waves.Interval)
+                || !ParseCount(argv[i + 2], waves.Burst)
+                || !ParseCount(argv[i + 3], waves.MaxPopulation)
+                || !ParseNumber(argv[i + 4], waves.MinRadius)
+                || !ParseNumber(argv[i + 5], waves.MaxRadius))
+                return Usage("--waves needs an interval, a burst, a max population and two radii");
+            i += 5;
+            waves_given = true;
+        }
+        else if (arg == "--max-spawned") {
+            if (!values(1) || !ParseCount(argv[++i], waves.MaxSpawned))
+                return Usage("--max-spawned needs a count");
+            max_spawned_given = true;
+        }
+        else if (arg == "--no-persistent") {
+            allow_persistent = false;
+        }
+        else if (arg == "--frame-budget") {
+            if (!values(1) || !ParseNumber(argv[++i], frame_budget_ms) || frame_budget_ms <= 0)
+                return Usage("--frame-budget needs a positive number of milliseconds");
+        }
+        else if (arg == "--occlusion") {
+            occlusion = true;
+        }
+        else if (arg == "--texture-budget") {
+            // In MiB, shifted into bytes below
+            if (!values(1) || !ParseCount(argv[++i], texture_budget_mib, size_t(1) << 20))
+                return Usage("--texture-budget needs a size in MiB");
+        }
+        else if (arg == "--gpu-fireballs") {
+            gpu_fireballs = true;
+        }
+        else if (arg == "--fireballs") {
+            if (!values(1) || !ParseCount(argv[++i], stress_balls, size_t(kMaxFireballs)))
+                return Usage("--fireballs needs a count of at most " + std::to_string(kMaxFireballs));
+        }
+    }
+    if (waves_given && !max_spawned_given)
+        waves.MaxSpawned = 0;
+    const auto wave_error = waves.Check();
+    if (!wave_error.empty()) {
+        fprintf(stderr, "--waves: %s\n", wave_error.c_str());
+        return -1;
+    }
+
     // Initialise GLFW
 
     if (!glfwInit())
@@ -323,7 +1285,7 @@ int main(void)
         return -1;
     }
 
-    glfwWindowHint(GLFW_SAMPLES, 4);
+    // No multisampling on the window itself, the scene is antialiased in SceneTarget
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
@@ -368,37 +1330,103 @@ int main(void)
     // Cull triangles which normal is not towards the camera
     glEnable(GL_CULL_FACE);
 
-    GLuint VertexArrayID;
-    glGenVertexArrays(1, &VertexArrayID);
-    glBindVertexArray(VertexArrayID);
+    auto VertexArray = GLHandle<GLKind::VertexArray>::Create();
+    glBindVertexArray(VertexArray.Get());
 
     initText2D("Holstein.DDS");
 
-    MetaObject MetaEnemy("haha.obj");
-    MetaEnemy.Textures["Texture"] = loadDDS("enemy.dds");
-    MetaEnemy.ProgramID = LoadShaders("TransformVertexShader.vertexshader", "TextureFragmentShader.fragmentshader");
-    // Get a handle for our "MVP" uniform
-    MetaEnemy.Values["MatrixID"] = glGetUniformLocation(MetaEnemy.ProgramID, "MVP");
+    auto streamer = texture_budget_mib > 0 ? std::make_unique<TextureStreamer>(texture_budget_mib << 20) : nullptr;
+    ResourceRegistry registry(streamer.get());
+    // Room for 32k per-draw blocks per frame at the usual 256 byte alignment
+    auto stream = std::make_unique<StreamBuffer>(GL_UNIFORM_BUFFER, 8 << 20, allow_persistent);
+    size_t frames = 0;
+    double submit_seconds = 0;
+    double stage_seconds = 0;
+
+    GLint max_samples = 1;
+    glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+    auto target = std::make_unique<SceneTarget>();
+    auto resolution = std::make_unique<ResolutionController>(frame_budget_ms, max_samples);
+
+    MetaObject MetaEnemy = MakeEnemyMeta(registry, true);
+    MetaEnemy.Textures["Texture"] = registry.LoadTexture("enemy.dds");
+    MetaEnemy.Program = registry.LoadProgram("TransformPerDrawVertexShader.vertexshader", "TextureFragmentShader.fragmentshader");
+    // Bind the "PerDraw" uniform block that carries the MVP
+    glUniformBlockBinding(MetaEnemy.Program->Id.Get(), glGetUniformBlockIndex(MetaEnemy.Program->Id.Get(), "PerDraw"), kPerDrawBinding);
 
     // Get a handle for our "myTextureSampler" uniform
-    MetaEnemy.Values["TextureID"] = glGetUniformLocation(MetaEnemy.ProgramID, "myTextureSampler");
-
-    MetaObject MetaBall("sphere.obj");
-    MetaBall.Scale = glm::scale(mat4(), { 0.1f, 0.1f, 0.1f });
-    MetaBall.Textures["Fire"] = loadBMP_custom("fire.bmp");
-    MetaBall.Textures["Noise"] = loadDDS("texture.dds");
-    MetaBall.ProgramID = LoadShaders("FireTransformVertexShader.vertexshader", "FireTextureFragmentShader.fragmentshader");
-    MetaBall.Values["MatrixID"] = glGetUniformLocation(MetaBall.ProgramID, "MVP");
-    MetaBall.Values["TextureID"] = glGetUniformLocation(MetaBall.ProgramID, "myTextureSampler");
-    MetaBall.Values["NoiseTextureID"] = glGetUniformLocation(MetaBall.ProgramID, "noiseTex");
-    MetaBall.Values["itime"] = glGetUniformLocation(MetaBall.ProgramID, "itime");
-
-    std::vector<std::unique_ptr<Enemy>> objs;
+    MetaEnemy.Values["TextureID"] = glGetUniformLocation(MetaEnemy.Program->Id.Get(), "myTextureSampler");
+
+    MetaObject MetaBall = MakeBallMeta(registry, true);
+    MetaBall.Textures["Fire"] = registry.LoadTexture("fire.bmp");
+    MetaBall.Textures["Noise"] = registry.LoadTexture("texture.dds");
+    MetaBall.Program = registry.LoadProgram("FireTransformPerDrawVertexShader.vertexshader", "FireTextureFragmentShader.fragmentshader");
+    glUniformBlockBinding(MetaBall.Program->Id.Get(), glGetUniformBlockIndex(MetaBall.Program->Id.Get(), "PerDraw"), kPerDrawBinding);
+    MetaBall.Values["TextureID"] = glGetUniformLocation(MetaBall.Program->Id.Get(), "myTextureSampler");
+    MetaBall.Values["NoiseTextureID"] = glGetUniformLocation(MetaBall.Program->Id.Get(), "noiseTex");
+    MetaBall.Values["itime"] = glGetUniformLocation(MetaBall.Program->Id.Get(), "itime");
+
+    // Everything is drawn through the queue, sorted by program, textures and mesh
+    RenderQueue queue;
+    queue.SetUniformBuffer(stream->Id(), kPerDrawBinding, sizeof(mat4));
+    float fire_time = 0;
+    MetaEnemy.ProgramKey = queue.AddProgram(MetaEnemy.Program->Id.Get(), -1, [&] {
+        // Set our "myTextureSampler" sampler to use Texture Unit 0
+        glUniform1i(MetaEnemy.Values["TextureID"], 0);
+        // After the depth pre-pass only the nearest surface passes, and nothing needs writing
+        if (occlusion) {
+            glDepthFunc(GL_LEQUAL);
+            glDepthMask(GL_FALSE);
+        }
+    });
+    MetaEnemy.MaterialKey = queue.AddMaterial({ { MetaEnemy.Textures["Texture"]->Id.Get(), 0 } });
+    MetaEnemy.MeshKey = queue.AddMesh({ { MetaEnemy.Mesh->VertexBuffer.Get(), MetaEnemy.Mesh->UvBuffer.Get(), 0 } });
+    MetaBall.ProgramKey = queue.AddProgram(MetaBall.Program->Id.Get(), -1, [&] {
+        glUniform1i(MetaBall.Values["TextureID"], 0);
+        glUniform1i(MetaBall.Values["NoiseTextureID"], 1);
+        glUniform1f(MetaBall.Values["itime"], fire_time);
+        // Balls are not in the pre-pass (their vertices move), so they test and write as usual
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+    });
+    MetaBall.MaterialKey = queue.AddMaterial({ { MetaBall.Textures["Fire"]->Id.Get(), MetaBall.Textures["Noise"]->Id.Get() } });
+    MetaBall.MeshKey = queue.AddMesh({ { MetaBall.Mesh->VertexBuffer.Get(), MetaBall.Mesh->UvBuffer.Get(), MetaBall.Mesh->NormalBuffer.Get() } });
+    RenderQueue::Stats queue_totals;
+
+    auto gpu_balls = gpu_fireballs ? std::make_unique<GpuFireballs>(registry, MetaBall, kFireballMesh) : nullptr;
+    // Vertex shader runs of the whole scene, where ARB_pipeline_statistics_query
+    // is there to count them, and the runs that sample the noise texture
+    const bool count_invocations = GLEW_ARB_pipeline_statistics_query;
+    GLHandle<GLKind::Query> invocation_queries[2];
+    if (count_invocations) {
+        for (auto& query : invocation_queries)
+            query = GLHandle<GLKind::Query>::Create();
+    }
+    GLuint64 invocations = 0;
+    size_t invocation_frames = 0;
+    size_t noise_lookups = 0;
+    size_t ball_count = 0;
+
+    auto culler = occlusion ? std::make_unique<OcclusionCuller>(registry) : nullptr;
+    // Samples that passed the depth test in the main pass, i.e. fragments shaded
+    // with early depth testing; read back a frame late
+    GLHandle<GLKind::Query> fragment_queries[2] = { GLHandle<GLKind::Query>::Create(), GLHandle<GLKind::Query>::Create() };
+    GLuint64 fragments = 0;
+    size_t fragment_frames = 0;
+    double frame_seconds = 0;
+
+    std::vector<Enemy> objs;
     std::vector<std::unique_ptr<Fireball>> balls;
     std::random_device rd;
-    ObjectGenerator<Enemy> gg(MetaEnemy, rd);
-
+    const uint32_t seed = rd();
+    std::mt19937 fireball_gen(seed);
     auto last_time = glfwGetTime();
+    ObjectGenerator<Enemy> gg(MetaEnemy, seed, last_time, waves);
+
+    Journal journal;
+    if (!record_name.empty() && !journal.OpenWrite(record_name, seed, last_time, waves, uint32_t(stress_balls)))
+        fprintf(stderr, "Failed to open journal %s, not recording\n", record_name.c_str());
+    uint32_t tick = 0;
     int mouseState = GLFW_RELEASE;
     int saveState = GLFW_RELEASE;
     int loadState = GLFW_RELEASE;
@@ -408,12 +1436,9 @@ int main(void)
 
     do {
         auto time = glfwGetTime();
-
-        // Clear the screen
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        // Use our shader
-        glUseProgram(MetaEnemy.ProgramID);
+        TickRecord record;
+        record.Tick = tick++;
+        record.Time = time;
 
         // Compute the MVP matrix from keyboard and mouse input
 
@@ -426,53 +1451,147 @@ int main(void)
 
         int curLoadState = glfwGetKey(window, GLFW_KEY_L);
         if (curLoadState == GLFW_RELEASE && loadState == GLFW_PRESS) {
-            std::vector<std::unique_ptr<Enemy>> nobjs;
+            std::vector<Enemy> nobjs;
             std::vector<std::unique_ptr<Fireball>> nballs;
-            load(nobjs, nballs, kills, "cool_save", { &MetaEnemy, &MetaBall });
+            // The journal keeps the save as it was loaded, so a replay does not
+            // depend on whatever cool_save holds by then
+            std::ifstream file("cool_save", std::fstream::in | std::fstream::binary);
+            record.Snapshot.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            std::istringstream snapshot(record.Snapshot);
+            load(nobjs, nballs, kills, snapshot, { &MetaEnemy, &MetaBall });
             objs = std::move(nobjs);
             balls = std::move(nballs);
+            record.Events |= TickRecord::kLoad;
         }
         loadState = curLoadState;
 
         computeMatricesFromInputs();
+        record.Position = getPosition();
+        record.Angels = getAngels();
         int currMouseState = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT);
         if (mouseState == GLFW_RELEASE && currMouseState == GLFW_PRESS) {
-            balls.emplace_back(std::make_unique<Fireball>(&MetaBall, getForward(), getPosition()));
+            record.Events |= TickRecord::kShoot;
+            record.Forward = getForward();
+            balls.emplace_back(std::make_unique<Fireball>(&MetaBall, record.Forward, record.Position));
         }
         mouseState = currMouseState;
 
-        std::vector<int> bad_enemys;
-        std::vector<int> bad_balls;
+        TopUpFireballs(balls, stress_balls, fireball_gen, &MetaBall, record.Position);
 
-        gg.Spawn(1, objs);
-        for (auto& obj : objs)
-            obj->Draw();
+        if (journal.IsOpen())
+            journal.Append(record);
 
-        glUseProgram(MetaBall.ProgramID);
+        Simulate(objs, balls, kills, gg, time, time - last_time);
 
-        glUniform1f(MetaBall.Values["itime"], time * 0.3);
+        // Draw the scene offscreen at the resolution the controller picked
+        int window_width = 0;
+        int window_height = 0;
+        glfwGetFramebufferSize(window, &window_width, &window_height);
+        resolution->BeginFrame();
+        auto& level = resolution->Current();
+        target->Resize(std::max(1, int(window_width * level.Scale)), std::max(1, int(window_height * level.Scale)), level.Samples);
+        target->Bind();
 
-        for (auto i = 0; i < balls.size(); ++i) {
-            if (!balls[i]->Update(time - last_time))
-                bad_balls.push_back(i);
+        // Clear the screen
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-            balls[i]->Draw();
+        // Stage every MVP of the frame first, so the upload is one contiguous write
+        auto submit_start = std::chrono::steady_clock::now();
+        stream->BeginFrame();
+        const glm::mat4 ViewProjection = getProjectionMatrix() * getViewMatrix();
+        for (auto& obj : objs)
+            obj.Stage(*stream, ViewProjection, occlusion);
+        if (gpu_balls)
+            gpu_balls->Stage(*stream, balls);
+        else {
+            for (auto& ball : balls)
+                ball->Stage(*stream, ViewProjection, occlusion);
         }
-
-        for (auto i = 0; i < balls.size(); ++i) {
-            for (auto j = 0; j < objs.size(); ++j) {
-                if (balls[i]->IsCollide(objs[j].get())) {
-                    bad_balls.push_back(i);
-                    bad_enemys.push_back(j);
-                    ++kills;
+        stream->Flush();
+        stage_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - submit_start).count();
+
+        auto& invocation_query = invocation_queries[frames % 2];
+        if (count_invocations) {
+            if (frames > 0) {
+                GLint available = 0;
+                glGetQueryObjectiv(invocation_query.Get(), GL_QUERY_RESULT_AVAILABLE, &available);
+                if (available) {
+                    GLuint64 count = 0;
+                    glGetQueryObjectui64v(invocation_query.Get(), GL_QUERY_RESULT, &count);
+                    invocations += count;
+                    ++invocation_frames;
                 }
             }
+            glBeginQuery(GL_VERTEX_SHADER_INVOCATIONS_ARB, invocation_query.Get());
         }
 
-        for (auto x : bad_balls)
-            balls.erase(balls.begin() + x);
-        for (auto x : bad_enemys)
-            objs.erase(objs.begin() + x);
+        fire_time = time * 0.3;
+        if (gpu_balls)
+            gpu_balls->Update(fire_time);
+        noise_lookups += gpu_balls ? kFireballMesh.Vertices.size() : balls.size() * MetaBall.Mesh->Vertices.size();
+        ball_count += balls.size();
+
+        if (streamer) {
+            // On-screen diameter of each object in scene pixels, for the textures it is drawn with
+            const float pixels_per_unit = getProjectionMatrix()[1][1] * target->Height();
+            auto request = [&](const Object& o) {
+                const float pixels = o.BoundingRadius() * pixels_per_unit / std::max(distance(o.Center(), getPosition()), 0.01f);
+                for (auto& texture : o.meta->Textures)
+                    streamer->Request(texture.second->Streamed.get(), pixels);
+            };
+            for (auto& obj : objs)
+                request(obj);
+            for (auto& ball : balls)
+                request(*ball);
+            streamer->Update();
+        }
+
+        if (culler) {
+            culler->BeginFrame();
+            culler->DepthPrepass(objs, *stream);
+            culler->IssueQueries(objs, *stream, getPosition());
+            if (!gpu_balls)
+                culler->IssueQueries(balls, *stream, getPosition());
+        }
+
+        auto& fragment_query = fragment_queries[frames % 2];
+        if (frames > 0) {
+            GLint available = 0;
+            glGetQueryObjectiv(fragment_query.Get(), GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                GLuint64 passed = 0;
+                glGetQueryObjectui64v(fragment_query.Get(), GL_QUERY_RESULT, &passed);
+                fragments += passed;
+                ++fragment_frames;
+            }
+        }
+        glBeginQuery(GL_SAMPLES_PASSED, fragment_query.Get());
+
+        for (auto& obj : objs)
+            obj.Submit(queue);
+        if (!gpu_balls) {
+            for (auto& ball : balls)
+                ball->Submit(queue);
+        }
+        queue.Flush();
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+        if (gpu_balls)
+            gpu_balls->Draw(*stream, ViewProjection, fire_time);
+        glEndQuery(GL_SAMPLES_PASSED);
+        if (count_invocations)
+            glEndQuery(GL_VERTEX_SHADER_INVOCATIONS_ARB);
+
+        // Upscale to the window; the HUD below is drawn at full resolution
+        target->Present(window_width, window_height);
+        resolution->EndFrame();
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        stream->EndFrame();
+        queue_totals += queue.LastStats();
+        submit_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - submit_start).count();
+        frame_seconds += time - last_time;
+        ++frames;
 
 
 
@@ -486,16 +1605,73 @@ int main(void)
         sprintf(fpsT, "%d", fps);
         printText2D(fpsT, 10, 200, 40);
 
+        if (streamer) {
+            char texturesT[32];
+            snprintf(texturesT, sizeof(texturesT), "tex %.1fM +%uK", streamer->ResidentBytes() / 1048576.0, unsigned(streamer->LastFrameBytes >> 10));
+            printText2D(texturesT, 10, 260, 20);
+        }
+
         last_time = time;
         // Swap buffers
         glfwSwapBuffers(window);
+        Garbage().EndFrame();
         glfwPollEvents();
     } // Check if the ESC key was pressed or the window was closed
     while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS &&
         glfwWindowShouldClose(window) == 0);
 
 
-    glDeleteVertexArrays(1, &VertexArrayID);
+    registry.PrintStats();
+    if (frames > 0) {
+        printf("stream buffer (%s): %zu frames, %.1f KiB/frame, staged and flushed in %.3f ms/frame, submit %.3f ms/frame, %zu stalls (%.2f ms), %zu overflows\n",
+            stream->IsPersistent() ? "persistent" : "orphaning", frames, stream->BytesStreamed / 1024.0 / frames,
+            stage_seconds * 1000 / frames, submit_seconds * 1000 / frames, stream->Stalls, stream->StallSeconds * 1000, stream->Overflows);
+        printf("render queue: %.1f draws/frame, %.1f state changes/frame (%.1f program, %.1f texture, %.1f mesh), %.1f without sorting and elision\n",
+            double(queue_totals.Draws) / frames, double(queue_totals.Changes()) / frames,
+            double(queue_totals.ProgramChanges) / frames, double(queue_totals.MaterialChanges) / frames,
+            double(queue_totals.MeshChanges) / frames, double(queue_totals.NaiveChanges) / frames);
+        printf("dynres: final scene %dx%d (scale %.2f, %dx MSAA), %zu changes, gpu %.2f ms\n",
+            target->Width(), target->Height(), resolution->Current().Scale, resolution->Current().Samples,
+            resolution->Changes, resolution->SmoothedMs());
+        printf("occlusion %s: %.0f fragments/frame passed depth in the main pass, %.1f ms/frame",
+            culler ? "on" : "off", fragment_frames > 0 ? double(fragments) / fragment_frames : 0.0, frame_seconds * 1000 / frames);
+        if (culler && culler->Frames() > 1) {
+            // Results are read a frame late, so the first frame has none
+            printf(", %.1f draws/frame skipped (%zu of %zu queried), %.1f/frame drawn without a query",
+                double(culler->Skipped) / (culler->Frames() - 1), culler->Skipped, culler->Tested,
+                double(culler->Unconditional) / culler->Frames());
+        }
+        printf("\n");
+        printf("fireballs (%s): %.1f/frame, %.0f noise-sampling vertex shader runs/frame",
+            gpu_balls ? "gpu" : "cpu", double(ball_count) / frames, double(noise_lookups) / frames);
+        if (invocation_frames > 0)
+            printf(", %.0f vertex shader invocations/frame in the scene", double(invocations) / invocation_frames);
+        if (gpu_balls)
+            printf(", %.1f KiB/frame of positions streamed", gpu_balls->UploadBytes / 1024.0 / frames);
+        printf("\n");
+        if (streamer)
+            printf("texture streaming: budget %.2f MiB, resident %.2f MiB (peak %.2f), %.1f KiB at startup, then %.1f KiB/frame (peak %.1f KiB), %zu levels uploaded, %zu dropped\n",
+                streamer->Budget() / 1048576.0, streamer->ResidentBytes() / 1048576.0, streamer->PeakResident / 1048576.0,
+                streamer->StartupBytes / 1024.0, streamer->UploadedBytes / 1024.0 / frames, streamer->PeakFrameBytes / 1024.0,
+                streamer->Promotions, streamer->Evictions);
+    }
+
+    // Drop every GL object while the context is still alive
+    objs.clear();
+    balls.clear();
+    gpu_balls.reset();
+    MetaEnemy = MetaObject();
+    MetaBall = MetaObject();
+    VertexArray.Reset();
+    stream.reset();
+    culler.reset();
+    for (auto& query : fragment_queries)
+        query.Reset();
+    for (auto& query : invocation_queries)
+        query.Reset();
+    target.reset();
+    resolution.reset();
+    Garbage().Flush();
     cleanupText2D();
 
     // Close OpenGL window and terminate GLFW
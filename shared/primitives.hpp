@@ -0,0 +1,374 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <array>
+
+// The generators need C++17 (if constexpr, constexpr std::array element access),
+// which MSVC only enables with /std:c++17; its default is C++14
+#ifdef _MSVC_LANG
+static_assert(_MSVC_LANG >= 201703L, "shared/primitives.hpp needs C++17: build with /std:c++17");
+#else
+static_assert(__cplusplus >= 201703L, "shared/primitives.hpp needs C++17: build with -std=c++17");
+#endif
+
+// Procedural meshes computed by the compiler. Each generator is constexpr, so
+//
+//   constexpr auto kSphere = primitives::UvSphere<32, 16>();
+//
+// at namespace scope puts the finished vertex and index arrays in static storage
+// and nothing runs at startup. Meshes are indexed, wound counter-clockwise seen
+// from outside, and centred on the origin with radius (or half extent) 1.
+namespace primitives {
+
+struct Vertex {
+    float Position[3];
+    float Uv[2];
+    float Normal[3];
+};
+
+template <size_t VertexCount, size_t IndexCount>
+struct Mesh {
+    static_assert(VertexCount <= 65536, "indices are 16 bit");
+
+    std::array<Vertex, VertexCount> Vertices;
+    std::array<uint16_t, IndexCount> Indices;
+};
+
+enum class Shading {
+    // Vertices shared between faces, normals straight out from the centre
+    Smooth,
+    // Every face has vertices of its own carrying the face normal
+    Flat,
+};
+
+namespace detail {
+
+constexpr double kPi = 3.14159265358979323846;
+
+// <cmath> is not constexpr, so the few functions needed are evaluated here in
+// double precision, well past what the float results keep
+
+constexpr double Sin(double x) {
+    while (x > kPi)
+        x -= 2 * kPi;
+    while (x < -kPi)
+        x += 2 * kPi;
+    double term = x;
+    double sum = x;
+    for (auto n = 1; n < 13; ++n) {
+        term *= -x * x / ((2 * n) * (2 * n + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+constexpr double Cos(double x) {
+    return Sin(x + kPi / 2);
+}
+
+constexpr double Sqrt(double x) {
+    if (x <= 0)
+        return 0;
+    double r = x > 1 ? x : 1;
+    for (auto i = 0; i < 64; ++i) {
+        const double next = 0.5 * (r + x / r);
+        if (next == r)
+            break;
+        r = next;
+    }
+    return r;
+}
+
+constexpr double Atan(double x) {
+    if (x > 1)
+        return kPi / 2 - Atan(1 / x);
+    if (x < -1)
+        return -kPi / 2 - Atan(1 / x);
+    // Halve the angle twice so the series converges quickly: |x| <= tan(pi / 16)
+    x = x / (1 + Sqrt(1 + x * x));
+    x = x / (1 + Sqrt(1 + x * x));
+    double power = x;
+    double sum = x;
+    for (auto n = 1; n < 16; ++n) {
+        power *= -x * x;
+        sum += power / (2 * n + 1);
+    }
+    return 4 * sum;
+}
+
+constexpr double Atan2(double y, double x) {
+    if (x > 0)
+        return Atan(y / x);
+    if (x < 0)
+        return y >= 0 ? Atan(y / x) + kPi : Atan(y / x) - kPi;
+    return y > 0 ? kPi / 2 : (y < 0 ? -kPi / 2 : 0);
+}
+
+constexpr Vertex MakeVertex(double x, double y, double z, double u, double v, double nx, double ny, double nz) {
+    return { { float(x), float(y), float(z) }, { float(u), float(v) }, { float(nx), float(ny), float(nz) } };
+}
+
+struct Vec3 {
+    double X, Y, Z;
+};
+
+constexpr Vertex MakeVertex(const Vec3& p, double u, double v, const Vec3& n) {
+    return MakeVertex(p.X, p.Y, p.Z, u, v, n.X, n.Y, n.Z);
+}
+
+// Unit normal of a counter-clockwise triangle
+constexpr Vec3 FaceNormal(const Vec3& a, const Vec3& b, const Vec3& c) {
+    const Vec3 e1 = { b.X - a.X, b.Y - a.Y, b.Z - a.Z };
+    const Vec3 e2 = { c.X - a.X, c.Y - a.Y, c.Z - a.Z };
+    const Vec3 n = { e1.Y * e2.Z - e1.Z * e2.Y, e1.Z * e2.X - e1.X * e2.Z, e1.X * e2.Y - e1.Y * e2.X };
+    const double length = Sqrt(n.X * n.X + n.Y * n.Y + n.Z * n.Z);
+    return { n.X / length, n.Y / length, n.Z / length };
+}
+
+struct SpherePoint {
+    Vec3 Position;
+    double U, V;
+};
+
+// Grid point of UvSphere; on the poles, the pole vertex of the column
+constexpr SpherePoint UvSpherePoint(int segments, int rings, int ring, int column) {
+    const double v = 1 - double(ring) / rings;
+    // Exact poles, the series leaves ~1e-16 at pi
+    if (ring == 0 || ring == rings)
+        return { { 0, ring == 0 ? 1.0 : -1.0, 0 }, (column + 0.5) / segments, v };
+    const double theta = kPi * ring / rings;
+    // Angle from -Z towards +X
+    const double phi = 2 * kPi * (0.75 - double(column) / segments);
+    const double radial = Sin(theta);
+    return { { radial * Sin(phi), Cos(theta), -radial * Cos(phi) }, double(column) / segments, v };
+}
+
+constexpr size_t Pow4(int n) {
+    return n == 0 ? 1 : 4 * Pow4(n - 1);
+}
+
+constexpr size_t UvSphereVertices(int segments, int rings, Shading normals) {
+    // Poles have a vertex per column, the other rings one more for the seam;
+    // flat, every quad has four vertices and every pole triangle three
+    return normals == Shading::Smooth ? size_t(2 * segments + (rings - 1) * (segments + 1))
+                                      : size_t(6 * segments + 4 * segments * (rings - 2));
+}
+
+}
+
+// 24 vertices so every face has its own normal and full 0..1 UVs
+constexpr Mesh<24, 36> Cube() {
+    Mesh<24, 36> mesh{};
+    size_t vertex = 0;
+    size_t index = 0;
+    for (auto axis = 0; axis < 3; ++axis) {
+        for (auto sign = 1; sign >= -1; sign -= 2) {
+            // Tangents chosen so that t1 x t2 = normal, which makes the corner
+            // order below counter-clockwise from outside
+            const int t1 = sign > 0 ? (axis + 1) % 3 : (axis + 2) % 3;
+            const int t2 = sign > 0 ? (axis + 2) % 3 : (axis + 1) % 3;
+            const int corners[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+            const size_t first = vertex;
+            for (auto& corner : corners) {
+                double position[3] = { 0, 0, 0 };
+                double normal[3] = { 0, 0, 0 };
+                position[axis] = sign;
+                position[t1] = corner[0];
+                position[t2] = corner[1];
+                normal[axis] = sign;
+                mesh.Vertices[vertex++] = detail::MakeVertex(position[0], position[1], position[2],
+                    (corner[0] + 1) / 2, (corner[1] + 1) / 2, normal[0], normal[1], normal[2]);
+            }
+            const size_t quad[6] = { 0, 1, 2, 0, 2, 3 };
+            for (auto i : quad)
+                mesh.Indices[index++] = uint16_t(first + i);
+        }
+    }
+    return mesh;
+}
+
+// Rings of latitude from the +Y pole down and columns in u order, laid out as
+// Blender's UV sphere exports them (sphere.obj is UvSphere<32, 16, Shading::Flat>):
+// u = 0.75 at -Z and falls towards +X, with the seam at -X, and v runs from 1 at
+// +Y to 0 at -Y. The seam column is duplicated so UVs run 0..1 without wrapping;
+// each pole triangle has a pole vertex of its own with u in the middle of its
+// column. Quads are split along the diagonal from (ring, column + 1) to
+// (ring + 1, column). Blender picks either one, both being the same length.
+template <int Segments, int Rings, Shading Normals = Shading::Smooth>
+constexpr Mesh<detail::UvSphereVertices(Segments, Rings, Normals), size_t(Segments) * (Rings - 1) * 6> UvSphere() {
+    static_assert(Segments >= 3 && Rings >= 2, "degenerate sphere");
+
+    Mesh<detail::UvSphereVertices(Segments, Rings, Normals), size_t(Segments) * (Rings - 1) * 6> mesh{};
+    size_t vertex = 0;
+    size_t index = 0;
+    if constexpr (Normals == Shading::Smooth) {
+        for (auto ring = 0; ring <= Rings; ++ring) {
+            const auto columns = ring == 0 || ring == Rings ? Segments : Segments + 1;
+            for (auto column = 0; column < columns; ++column) {
+                auto p = detail::UvSpherePoint(Segments, Rings, ring, column);
+                mesh.Vertices[vertex++] = detail::MakeVertex(p.Position, p.U, p.V, p.Position);
+            }
+        }
+        auto at = [](int ring, int column) {
+            if (ring == 0)
+                return uint16_t(column);
+            return uint16_t(Segments + (ring - 1) * (Segments + 1) + column);
+        };
+        for (auto ring = 0; ring < Rings; ++ring) {
+            for (auto column = 0; column < Segments; ++column) {
+                // The poles have one vertex per column, at the quad's first corner
+                const auto a = at(ring, column);
+                const auto b = ring == 0 ? a : at(ring, column + 1);
+                const auto c = at(ring + 1, column);
+                const auto d = ring + 1 == Rings ? c : at(ring + 1, column + 1);
+                if (ring != 0) {
+                    mesh.Indices[index++] = a;
+                    mesh.Indices[index++] = c;
+                    mesh.Indices[index++] = b;
+                }
+                if (ring != Rings - 1) {
+                    mesh.Indices[index++] = b;
+                    mesh.Indices[index++] = c;
+                    mesh.Indices[index++] = d;
+                }
+            }
+        }
+    }
+    else {
+        for (auto ring = 0; ring < Rings; ++ring) {
+            for (auto column = 0; column < Segments; ++column) {
+                const auto a = detail::UvSpherePoint(Segments, Rings, ring, column);
+                const auto b = ring == 0 ? a : detail::UvSpherePoint(Segments, Rings, ring, column + 1);
+                const auto c = detail::UvSpherePoint(Segments, Rings, ring + 1, column);
+                const auto d = ring + 1 == Rings ? c : detail::UvSpherePoint(Segments, Rings, ring + 1, column + 1);
+                // The quads are flat, so either triangle gives the face normal
+                detail::Vec3 normal = ring == 0 ? detail::FaceNormal(b.Position, c.Position, d.Position)
+                                                : detail::FaceNormal(a.Position, c.Position, b.Position);
+                const auto first = uint16_t(vertex);
+                uint16_t corner[4] = { first, first, first, first };
+                mesh.Vertices[vertex++] = detail::MakeVertex(a.Position, a.U, a.V, normal);
+                if (ring != 0) {
+                    corner[1] = uint16_t(vertex);
+                    mesh.Vertices[vertex++] = detail::MakeVertex(b.Position, b.U, b.V, normal);
+                }
+                corner[2] = uint16_t(vertex);
+                mesh.Vertices[vertex++] = detail::MakeVertex(c.Position, c.U, c.V, normal);
+                corner[3] = corner[2];
+                if (ring != Rings - 1) {
+                    corner[3] = uint16_t(vertex);
+                    mesh.Vertices[vertex++] = detail::MakeVertex(d.Position, d.U, d.V, normal);
+                }
+                if (ring != 0) {
+                    mesh.Indices[index++] = corner[0];
+                    mesh.Indices[index++] = corner[2];
+                    mesh.Indices[index++] = corner[1];
+                }
+                if (ring != Rings - 1) {
+                    mesh.Indices[index++] = corner[1];
+                    mesh.Indices[index++] = corner[2];
+                    mesh.Indices[index++] = corner[3];
+                }
+            }
+        }
+    }
+    return mesh;
+}
+
+// Icosahedron with every triangle split into four, Subdivisions times, and the
+// new vertices pushed out to the unit sphere. Vertices are shared, so the
+// spherical UVs are not split at the seam: a texture wraps backwards across the
+// column of triangles that straddles it. Use UvSphere for textured meshes.
+template <int Subdivisions>
+constexpr Mesh<10 * detail::Pow4(Subdivisions) + 2, 60 * detail::Pow4(Subdivisions)> Icosphere() {
+    constexpr size_t kVertices = 10 * detail::Pow4(Subdivisions) + 2;
+    constexpr size_t kIndices = 60 * detail::Pow4(Subdivisions);
+
+    double positions[kVertices][3] = {};
+    uint16_t indices[kIndices] = {};
+    uint16_t scratch[kIndices] = {};
+
+    const double t = (1 + detail::Sqrt(5)) / 2;
+    const double base[12][3] = {
+        { -1, t, 0 }, { 1, t, 0 }, { -1, -t, 0 }, { 1, -t, 0 },
+        { 0, -1, t }, { 0, 1, t }, { 0, -1, -t }, { 0, 1, -t },
+        { t, 0, -1 }, { t, 0, 1 }, { -t, 0, -1 }, { -t, 0, 1 },
+    };
+    const uint16_t faces[60] = {
+        0, 11, 5, 0, 5, 1, 0, 1, 7, 0, 7, 10, 0, 10, 11,
+        1, 5, 9, 5, 11, 4, 11, 10, 2, 10, 7, 6, 7, 1, 8,
+        3, 9, 4, 3, 4, 2, 3, 2, 6, 3, 6, 8, 3, 8, 9,
+        4, 9, 5, 2, 4, 11, 6, 2, 10, 8, 6, 7, 9, 8, 1,
+    };
+    const double base_length = detail::Sqrt(1 + t * t);
+    for (auto i = 0; i < 12; ++i)
+        for (auto k = 0; k < 3; ++k)
+            positions[i][k] = base[i][k] / base_length;
+    for (auto i = 0; i < 60; ++i)
+        indices[i] = faces[i];
+
+    size_t vertex_count = 12;
+    size_t index_count = 60;
+    for (auto level = 0; level < Subdivisions; ++level) {
+        // Midpoints already made this level, keyed by the lower vertex of the
+        // edge. No vertex has more than six neighbours.
+        uint16_t other[kVertices][6] = {};
+        uint16_t middle[kVertices][6] = {};
+        uint8_t edges[kVertices] = {};
+
+        size_t out = 0;
+        for (size_t i = 0; i < index_count; i += 3) {
+            uint16_t mid[3] = {};
+            for (auto e = 0; e < 3; ++e) {
+                const uint16_t a = indices[i + e];
+                const uint16_t b = indices[i + (e + 1) % 3];
+                const uint16_t low = a < b ? a : b;
+                const uint16_t high = a < b ? b : a;
+                bool found = false;
+                for (auto k = 0; k < edges[low]; ++k) {
+                    if (other[low][k] == high) {
+                        mid[e] = middle[low][k];
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    double p[3] = {};
+                    for (auto k = 0; k < 3; ++k)
+                        p[k] = (positions[a][k] + positions[b][k]) / 2;
+                    const double length = detail::Sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+                    for (auto k = 0; k < 3; ++k)
+                        positions[vertex_count][k] = p[k] / length;
+                    mid[e] = uint16_t(vertex_count++);
+                    other[low][edges[low]] = high;
+                    middle[low][edges[low]] = mid[e];
+                    ++edges[low];
+                }
+            }
+            const uint16_t a = indices[i];
+            const uint16_t b = indices[i + 1];
+            const uint16_t c = indices[i + 2];
+            const uint16_t split[12] = { a, mid[0], mid[2], b, mid[1], mid[0], c, mid[2], mid[1], mid[0], mid[1], mid[2] };
+            for (auto s : split)
+                scratch[out++] = s;
+        }
+        index_count = out;
+        for (size_t i = 0; i < index_count; ++i)
+            indices[i] = scratch[i];
+    }
+
+    Mesh<kVertices, kIndices> mesh{};
+    for (size_t i = 0; i < kVertices; ++i) {
+        const double x = positions[i][0];
+        const double y = positions[i][1];
+        const double z = positions[i][2];
+        // Same orientation as UvSphere: u = 0.75 at -Z, falling towards +X
+        const double u = 0.75 - detail::Atan2(x, -z) / (2 * detail::kPi);
+        const double v = 0.5 + detail::Atan2(y, detail::Sqrt(x * x + z * z)) / detail::kPi;
+        mesh.Vertices[i] = detail::MakeVertex(x, y, z, u >= 1 ? u - 1 : u, v, x, y, z);
+    }
+    for (size_t i = 0; i < kIndices; ++i)
+        mesh.Indices[i] = indices[i];
+    return mesh;
+}
+
+}
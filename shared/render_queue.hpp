@@ -0,0 +1,201 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+// Collects the draws of a frame as packets keyed by program, material and mesh,
+// sorts them by that key and submits them, binding a program, texture set or
+// vertex layout only when it differs from the previous packet's.
+//
+// Key layout, most significant first:
+//   16 bits program | 16 bits material | 16 bits mesh | 16 bits free (order inside a batch)
+class RenderQueue {
+public:
+    // Up to two textures bound to units 0 and 1; 0 leaves a unit alone
+    struct Material {
+        GLuint Textures[2] = { 0, 0 };
+    };
+
+    // Non-interleaved attributes 0..2; a zero buffer disables the attribute
+    struct Mesh {
+        GLuint Buffers[3] = { 0, 0, 0 };
+        GLint Sizes[3] = { 3, 2, 3 };
+        GLenum Mode = GL_TRIANGLES;
+    };
+
+    struct Draw {
+        GLint First = 0;
+        GLsizei Count = 0;
+        // Range in the per-draw uniform buffer, see SetUniformBuffer; -1 if unused
+        GLintptr UniformOffset = -1;
+        // Written to the program's parameter uniform, if it has one
+        glm::vec4 Param;
+        // Occlusion query the draw is conditional on; 0 draws unconditionally
+        GLuint Condition = 0;
+    };
+
+    struct Stats {
+        size_t Draws = 0;
+        size_t ProgramChanges = 0;
+        size_t MaterialChanges = 0;
+        size_t MeshChanges = 0;
+        // What the same packets cost when every draw sets all of its state
+        size_t NaiveChanges = 0;
+
+        size_t Changes() const {
+            return ProgramChanges + MaterialChanges + MeshChanges;
+        }
+
+        Stats& operator+=(const Stats& other) {
+            Draws += other.Draws;
+            ProgramChanges += other.ProgramChanges;
+            MaterialChanges += other.MaterialChanges;
+            MeshChanges += other.MeshChanges;
+            NaiveChanges += other.NaiveChanges;
+            return *this;
+        }
+    };
+
+    // on_bind runs right after the program is bound; use it for uniforms shared by
+    // the whole batch. param_location receives Draw::Param, -1 for none.
+    uint16_t AddProgram(GLuint program, GLint param_location = -1, std::function<void()> on_bind = nullptr) {
+        programs_.push_back({ program, param_location, std::move(on_bind) });
+        return uint16_t(programs_.size() - 1);
+    }
+
+    uint16_t AddMaterial(const Material& material) {
+        materials_.push_back(material);
+        return uint16_t(materials_.size() - 1);
+    }
+
+    uint16_t AddMesh(const Mesh& mesh) {
+        meshes_.push_back(mesh);
+        return uint16_t(meshes_.size() - 1);
+    }
+
+    // Buffer and binding point that Draw::UniformOffset refers to
+    void SetUniformBuffer(GLuint buffer, GLuint binding, GLsizeiptr size) {
+        uniform_buffer_ = buffer;
+        uniform_binding_ = binding;
+        uniform_size_ = size;
+    }
+
+    void Submit(uint16_t program, uint16_t material, uint16_t mesh, const Draw& draw, uint16_t order = 0) {
+        const uint64_t key = uint64_t(program) << 48 | uint64_t(material) << 32 | uint64_t(mesh) << 16 | order;
+        packets_.push_back({ key, draw });
+    }
+
+    // Sorts and issues everything submitted since the last call
+    void Flush() {
+        Sort();
+
+        Stats stats;
+        uint64_t last = ~uint64_t(0);
+        GLuint textures[2] = { 0, 0 };
+        for (auto& packet : packets_) {
+            const uint16_t program = packet.Key >> 48;
+            const uint16_t material = packet.Key >> 32 & 0xFFFF;
+            const uint16_t mesh = packet.Key >> 16 & 0xFFFF;
+            auto& p = programs_[program];
+            auto& mat = materials_[material];
+            auto& m = meshes_[mesh];
+
+            if (last == ~uint64_t(0) || program != last >> 48) {
+                glUseProgram(p.Id);
+                if (p.OnBind)
+                    p.OnBind();
+                ++stats.ProgramChanges;
+            }
+            if (last == ~uint64_t(0) || (last >> 32) != (packet.Key >> 32)) {
+                for (auto unit = 0; unit < 2; ++unit) {
+                    if (mat.Textures[unit] && mat.Textures[unit] != textures[unit]) {
+                        glActiveTexture(GL_TEXTURE0 + unit);
+                        glBindTexture(GL_TEXTURE_2D, mat.Textures[unit]);
+                        textures[unit] = mat.Textures[unit];
+                        ++stats.MaterialChanges;
+                    }
+                }
+            }
+            if (last == ~uint64_t(0) || (last >> 16) != (packet.Key >> 16)) {
+                BindMesh(m);
+                ++stats.MeshChanges;
+            }
+            last = packet.Key;
+
+            if (packet.Args.UniformOffset >= 0)
+                glBindBufferRange(GL_UNIFORM_BUFFER, uniform_binding_, uniform_buffer_, packet.Args.UniformOffset, uniform_size_);
+            if (p.ParamLocation >= 0)
+                glUniform4fv(p.ParamLocation, 1, &packet.Args.Param[0]);
+            if (packet.Args.Condition)
+                glBeginConditionalRender(packet.Args.Condition, GL_QUERY_WAIT);
+            glDrawArrays(m.Mode, packet.Args.First, packet.Args.Count);
+            if (packet.Args.Condition)
+                glEndConditionalRender();
+            ++stats.Draws;
+
+            stats.NaiveChanges += 1 + (mat.Textures[0] != 0) + (mat.Textures[1] != 0) + 1;
+        }
+        packets_.clear();
+        last_stats_ = stats;
+    }
+
+    const Stats& LastStats() const {
+        return last_stats_;
+    }
+
+private:
+    struct Program {
+        GLuint Id;
+        GLint ParamLocation;
+        std::function<void()> OnBind;
+    };
+
+    struct Packet {
+        uint64_t Key;
+        Draw Args;
+    };
+
+    void BindMesh(const Mesh& mesh) {
+        for (GLuint attribute = 0; attribute < 3; ++attribute) {
+            if (!mesh.Buffers[attribute]) {
+                glDisableVertexAttribArray(attribute);
+                continue;
+            }
+            glEnableVertexAttribArray(attribute);
+            glBindBuffer(GL_ARRAY_BUFFER, mesh.Buffers[attribute]);
+            glVertexAttribPointer(attribute, mesh.Sizes[attribute], GL_FLOAT, GL_FALSE, 0, (void*)0);
+        }
+    }
+
+    // LSD radix sort on the key, one byte per pass; passes where every key has
+    // the same byte are skipped, which is most of them for a small scene
+    void Sort() {
+        scratch_.resize(packets_.size());
+        for (auto shift = 0; shift < 64; shift += 8) {
+            size_t counts[257] = {};
+            for (auto& packet : packets_)
+                ++counts[(packet.Key >> shift & 0xFF) + 1];
+            if (!packets_.empty() && counts[(packets_[0].Key >> shift & 0xFF) + 1] == packets_.size())
+                continue;
+            for (auto i = 1; i < 257; ++i)
+                counts[i] += counts[i - 1];
+            for (auto& packet : packets_)
+                scratch_[counts[packet.Key >> shift & 0xFF]++] = packet;
+            packets_.swap(scratch_);
+        }
+    }
+
+    std::vector<Program> programs_;
+    std::vector<Material> materials_;
+    std::vector<Mesh> meshes_;
+    std::vector<Packet> packets_;
+    std::vector<Packet> scratch_;
+    GLuint uniform_buffer_ = 0;
+    GLuint uniform_binding_ = 0;
+    GLsizeiptr uniform_size_ = 0;
+    Stats last_stats_;
+};